@@ -7,8 +7,11 @@
 
 
 #include <mdinv_config.hpp>
+#include <mdinv_log.hpp>
 #include <mdinv_gui.hpp>
 #include <mdinv_window_event.hpp>
+#include <mdinv_server.hpp>
+#include <mdinv_scene_prep.hpp>
 
 #include <nirtcpp.hpp>
 
@@ -16,18 +19,68 @@
 #include <utxcpp/thread.hpp>
 
 #include <filesystem>
+#include <string_view>
+#include <vector>
 
-int main()
+int main(int argc, char * argv[])
 try
 {
-	std::unique_lock lock{utx::mutex0};
-	utx::print("------------------------------------------------------------------------");
-	utx::print(mdinv::app_init_info.description(), "\n\n", mdinv::app_init_info.license());
-	utx::print("------------------------------------------------------------------------");
-	utx::print("init resolution:", mdinv::app_init_info.width(), 'x', mdinv::app_init_info.height());
-	utx::print("update resolution:", mdinv::app_update_info.width(), 'x', mdinv::app_update_info.height());
-	utx::print("------------------------------------------------------------------------");
-	lock.unlock();
+	const std::vector<std::string_view> args{argv+1, argv+argc};
+
+	// mdinv [--log-level debug|info|warn|error|off] [--log-file <path>]
+	//       [--prep-threads <n>] [--compact-vertices] [--serve [socket]]
+	bool serve = false;
+	utx::u32 prep_threads = 0;
+	bool compact_vertices = false;
+	std::string socket_path = mdinv::app_init_info.socket_path();
+	for (std::size_t i=0; i<args.size(); i++)
+	{
+		if (args[i] == "--serve")
+		{
+			serve = true;
+			if (i+1 < args.size() && ! args[i+1].starts_with("--"))
+				socket_path = std::string{args[++i]};
+		}
+		else if (args[i] == "--log-level" && i+1 < args.size())
+		{
+			auto level = mdinv::parse_log_level(args[++i]);
+			if (! level)
+				throw std::runtime_error{"unknown log level: " + std::string{args[i]}};
+			mdinv::app_logger.set_level(*level);
+		}
+		else if (args[i] == "--log-file" && i+1 < args.size())
+		{
+			mdinv::app_logger.open_file(args[++i]);
+		}
+		else if (args[i] == "--compact-vertices")
+		{
+			compact_vertices = true;
+		}
+		else if (args[i] == "--prep-threads" && i+1 < args.size())
+		{
+			prep_threads = static_cast<utx::u32>(std::stoul(std::string{args[++i]}));
+		}
+		else
+		{
+			throw std::runtime_error{"unknown argument: " + std::string{args[i]}};
+		}
+	}
+
+	if (serve)
+	{
+		if (socket_path.empty())
+			throw std::runtime_error{"XDG_RUNTIME_DIR is not set, give --serve a socket path"};
+		mdinv::render_server server{socket_path};
+		server.run();
+		return 0;
+	}
+
+	mdinv::log_info("------------------------------------------------------------------------");
+	mdinv::log_info(mdinv::app_init_info.description(), "\n\n", mdinv::app_init_info.license());
+	mdinv::log_info("------------------------------------------------------------------------");
+	mdinv::log_info("init resolution:", mdinv::app_init_info.width(), 'x', mdinv::app_init_info.height());
+	mdinv::log_info("update resolution:", mdinv::app_update_info.width(), 'x', mdinv::app_update_info.height());
+	mdinv::log_info("------------------------------------------------------------------------");
 	nirt::NirtcppDevice * win_device = nirt::createDevice(
 		nirt::video::EDT_OPENGL,
 		mdinv::app_update_info.dimension(),
@@ -43,7 +96,6 @@ try
 	win_device->setWindowCaption(mdinv::app_update_info.title().data());
 
 	nirt::video::IVideoDriver * win_driver = win_device->getVideoDriver();
-	nirt::scene::ISceneManager * win_smgr = win_device->getSceneManager();
 	nirt::gui::IGUIEnvironment * win_gui = win_device->getGUIEnvironment();
 	
 	mdinv::create_gui(win_device, win_gui);
@@ -51,79 +103,93 @@ try
 	nirt::gui::ICursorControl * cursor = win_device->getCursorControl();
 	cursor->setVisible(true);
 		
-	mdinv::window_event win_event{win_device, 10000.0f};
+	// Everything holding meshes, textures or the event receiver goes before the device.
+	{
+		mdinv::compact_store compact{win_device, compact_vertices};
 
-	win_device->setEventReceiver(&win_event);
+		mdinv::window_event win_event{win_device, 10000.0f, compact};
 
-	mdinv::app_update_info.update_dimension(win_driver->getScreenSize());
-	utx::i32 width = static_cast<utx::i32>(mdinv::app_update_info.width());
-	utx::i32 height = static_cast<utx::i32>(mdinv::app_update_info.height());
+		win_device->setEventReceiver(&win_event);
 
-	while (win_device->run())
-	{
-		if (win_device->isWindowActive())
+		mdinv::scene_prep scene{win_device, prep_threads, compact};
+
+		mdinv::app_update_info.update_dimension(win_driver->getScreenSize());
+		utx::i32 width = static_cast<utx::i32>(mdinv::app_update_info.width());
+		utx::i32 height = static_cast<utx::i32>(mdinv::app_update_info.height());
+
+		while (win_device->run())
 		{
-			win_driver->setViewPort(nirt::core::recti{0, 0, width, height});
-			win_driver->beginScene(true, true, nirt::video::SColor{0xff335774});
+			if (win_device->isWindowActive())
+			{
+				win_event.apply_reloads();
 
-			mdinv::app_update_info.update_dimension(win_driver->getScreenSize());
-			width = static_cast<utx::i32>(mdinv::app_update_info.width());
-			height = static_cast<utx::i32>(mdinv::app_update_info.height());
+				win_driver->setViewPort(nirt::core::recti{0, 0, width, height});
+				win_driver->beginScene(true, true, nirt::video::SColor{0xff335774});
 
-			utx::i32 splitx = mdinv::app_init_info.splitx();
-			utx::i32 splity = mdinv::app_init_info.splity();
+				mdinv::app_update_info.update_dimension(win_driver->getScreenSize());
+				width = static_cast<utx::i32>(mdinv::app_update_info.width());
+				height = static_cast<utx::i32>(mdinv::app_update_info.height());
 
-			utx::i32 slidex = width/splitx;
-			utx::i32 slidey = height/splity;
+				utx::i32 splitx = mdinv::app_init_info.splitx();
+				utx::i32 splity = mdinv::app_init_info.splity();
 
+				utx::i32 slidex = width/splitx;
+				utx::i32 slidey = height/splity;
 
-			for (utx::i32 j=0; j<splity; j++)
-			{
-				for (utx::i32 i=0; i<splitx; i++)
-				{
-					utx::i32 y = slidey * j;
-					utx::i32 x = slidex * i;
+				scene.prepare(win_event.mesh_list(), win_event.camera_list(), win_device->getTimer()->getTime());
 
-					win_smgr->setActiveCamera(win_event.camera(j*splitx+i));
-					win_driver->setViewPort(nirt::core::recti{x, y, x+slidex, y+slidey});
-					win_smgr->drawAll();
+				for (utx::i32 j=0; j<splity; j++)
+				{
+					for (utx::i32 i=0; i<splitx; i++)
+					{
+						utx::i32 y = slidey * j;
+						utx::i32 x = slidex * i;
+
+						win_driver->setViewPort(nirt::core::recti{x, y, x+slidex, y+slidey});
+						scene.replay(j*splitx+i);
+					}
 				}
-			}
 
-			////////////////////////////////////////////////////////////////////////
+				////////////////////////////////////////////////////////////////////////
 
-			// Restore default View Port
-			win_driver->setViewPort(nirt::core::recti{0, 0, width, height});
-			win_gui->drawAll();
+				// Restore default View Port
+				win_driver->setViewPort(nirt::core::recti{0, 0, width, height});
+				win_gui->drawAll();
 
-			win_driver->endScene();
-		}
-		else
-		{
-			win_device->yield();
+				win_driver->endScene();
+
+				win_event.frame_presented();
+				scene.frame_done();
+			}
+			else
+			{
+				win_device->yield();
+			}
 		}
+
+		win_device->setEventReceiver(nullptr);
 	}
 
 	win_device->drop();
 
-	lock.lock();
-	utx::print("------------------------------------------------------------------------");
-	utx::print(
+	mdinv::log_info("------------------------------------------------------------------------");
+	mdinv::log_info(
 		"Window is closed.", '\n', 
 		"Last window resolution:", mdinv::app_update_info.width(), 'x', mdinv::app_update_info.height()
 	);
-	utx::print("------------------------------------------------------------------------");
-	lock.unlock();
+	mdinv::log_info("------------------------------------------------------------------------");
 }
 catch (const std::exception & err)
 {
-	utx::printe("---- c++ standard exception ----");
-	utx::printe(err.what());
+	mdinv::log_error("---- c++ standard exception ----");
+	mdinv::log_error(err.what());
+	mdinv::app_logger.flush();
 	return 1;
 }
 catch (...)
 {
-	utx::printe("---- c++ unknown exception ----");
+	mdinv::log_error("---- c++ unknown exception ----");
+	mdinv::app_logger.flush();
 	return 2;
 }
 
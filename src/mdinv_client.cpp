@@ -0,0 +1,169 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+// Local client for `mdinv --serve`.
+//
+//	mdinv_client [--socket <path>] [--concurrent <n>] [--repeat <n>] <request> [<field> ...]
+//
+// Sends the request on <concurrent> connections at the same time, <repeat>
+// times on each, prints every reply and the round trip latencies seen.
+// It does not include mdinv_config.hpp on purpose: that creates a device.
+
+#include <utxcpp/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mdinv_client
+{
+
+// Same default as application_init_info::socket_path().
+auto default_socket_path = [] () -> std::string
+{
+	const char * dir = std::getenv("XDG_RUNTIME_DIR");
+	if (! dir || ! *dir)
+		return {};
+	return std::string{dir} + "/mdinv-3d-viewer.sock";
+};
+
+auto connect_socket = [] (const std::string & path) -> int
+{
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		throw std::runtime_error{"can not create socket"};
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error{"socket path is too long: " + path};
+	std::copy(path.begin(), path.end(), addr.sun_path);
+	if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+	{
+		::close(fd);
+		throw std::runtime_error{"can not connect to " + path};
+	}
+	return fd;
+};
+
+auto request = [] (int fd, const std::string & line) -> std::string
+{
+	const std::string out = line + '\n';
+	if (::send(fd, out.data(), out.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(out.size()))
+		throw std::runtime_error{"send failed"};
+	std::string reply;
+	char ch;
+	while (::recv(fd, &ch, 1, 0) == 1 && ch != '\n')
+		reply += ch;
+	return reply;
+};
+
+} // namespace mdinv_client
+
+int main(int argc, char * argv[])
+try
+{
+	std::string socket_path = mdinv_client::default_socket_path();
+	utx::u32 concurrent = 1;
+	utx::u32 repeat = 1;
+	std::vector<std::string> fields;
+
+	for (int i=1; i<argc; i++)
+	{
+		const std::string_view arg = argv[i];
+		if (arg == "--socket" && i+1 < argc)
+			socket_path = argv[++i];
+		else if (arg == "--concurrent" && i+1 < argc)
+			concurrent = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--repeat" && i+1 < argc)
+			repeat = std::max(1, std::stoi(argv[++i]));
+		else
+			fields.emplace_back(arg);
+	}
+	if (fields.empty())
+	{
+		utx::printe("usage: mdinv_client [--socket <path>] [--concurrent <n>] [--repeat <n>] <request> [<field> ...]");
+		return 1;
+	}
+	if (socket_path.empty())
+	{
+		utx::printe("XDG_RUNTIME_DIR is not set, give a socket path with --socket");
+		return 1;
+	}
+
+	std::string line = fields[0];
+	for (std::size_t i=1; i<fields.size(); i++)
+		line += '\t' + fields[i];
+
+	std::vector<std::vector<double>> latencies(concurrent);
+	std::vector<std::vector<std::string>> replies(concurrent);
+	{
+		std::vector<std::jthread> clients;
+		for (utx::u32 c=0; c<concurrent; c++)
+		{
+			clients.emplace_back([&, c] {
+				try
+				{
+					int fd = mdinv_client::connect_socket(socket_path);
+					for (utx::u32 r=0; r<repeat; r++)
+					{
+						const auto start = std::chrono::steady_clock::now();
+						replies[c].push_back(mdinv_client::request(fd, line));
+						latencies[c].push_back(std::chrono::duration<double, std::milli>(
+							std::chrono::steady_clock::now() - start
+						).count());
+					}
+					::close(fd);
+				}
+				catch (const std::exception & err)
+				{
+					replies[c].push_back(std::string{"error "} + err.what());
+				}
+			});
+		}
+	}
+
+	std::vector<double> all;
+	bool failed = false;
+	for (utx::u32 c=0; c<concurrent; c++)
+	{
+		for (const std::string & reply: replies[c])
+		{
+			utx::print(reply);
+			failed = failed || ! reply.starts_with("ok");
+		}
+		all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+	}
+	if (! all.empty())
+	{
+		std::ranges::sort(all);
+		double total = 0;
+		for (double ms: all)
+			total += ms;
+		utx::print(
+			"round trip ms: min", all.front(),
+			"| median", all[all.size()/2],
+			"| avg", total/all.size(),
+			"| max", all.back(),
+			"| requests", all.size()
+		);
+	}
+	return failed ? 1 : 0;
+}
+catch (const std::exception & err)
+{
+	utx::printe("---- c++ standard exception ----");
+	utx::printe(err.what());
+	return 1;
+}
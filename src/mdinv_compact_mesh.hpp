@@ -0,0 +1,516 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_compact_mesh_hpp__
+#define __mdinv_src_mdinv_compact_mesh_hpp__
+
+#include <mdinv_config.hpp>
+#include <mdinv_log.hpp>
+
+#include <nirtcpp.hpp>
+#include <utxcpp/core.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <unordered_map>
+#include <vector>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// Vertex quantization
+
+namespace quantize
+{
+
+inline std::uint16_t to_half(utx::f32 value)
+{
+	const std::uint32_t x = std::bit_cast<std::uint32_t>(value);
+	const std::uint32_t sign = (x >> 16) & 0x8000;
+	const std::int32_t exponent = static_cast<std::int32_t>((x >> 23) & 0xff) - 127 + 15;
+	std::uint32_t mantissa = x & 0x7fffff;
+
+	if ((x & 0x7fffffff) > 0x7f800000)
+		return static_cast<std::uint16_t>(sign | 0x7e00);	// NaN
+	if (exponent >= 31)
+		return static_cast<std::uint16_t>(sign | 0x7c00);	// too big: infinity
+	if (exponent <= 0)
+	{
+		// Subnormal half, or zero.
+		if (exponent < -10)
+			return static_cast<std::uint16_t>(sign);
+		mantissa |= 0x800000;
+		const std::uint32_t shift = static_cast<std::uint32_t>(14 - exponent);
+		std::uint32_t half = mantissa >> shift;
+		if ((mantissa >> (shift-1)) & 1)
+			half++;
+		return static_cast<std::uint16_t>(sign | half);
+	}
+	std::uint32_t half = sign | (static_cast<std::uint32_t>(exponent) << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+		half++;	// rounding may carry into the exponent, which is still right
+	return static_cast<std::uint16_t>(half);
+}
+
+inline utx::f32 from_half(std::uint16_t half)
+{
+	const std::uint32_t sign = static_cast<std::uint32_t>(half & 0x8000) << 16;
+	const std::uint32_t exponent = (half >> 10) & 0x1f;
+	const std::uint32_t mantissa = half & 0x3ff;
+	if (exponent == 0)
+	{
+		const utx::f32 value = std::ldexp(static_cast<utx::f32>(mantissa), -24);
+		return sign ? -value : value;
+	}
+	if (exponent == 31)
+		return std::bit_cast<utx::f32>(sign | 0x7f800000 | (mantissa << 13));
+	return std::bit_cast<utx::f32>(sign | ((exponent - 15 + 127) << 23) | (mantissa << 13));
+}
+
+inline std::int16_t to_snorm16(utx::f32 value)
+{
+	return static_cast<std::int16_t>(std::lround(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+}
+
+inline utx::f32 from_snorm16(std::int16_t value)
+{
+	return std::max(static_cast<utx::f32>(value) / 32767.0f, -1.0f);
+}
+
+// Octahedral normal encoding: the unit sphere folded onto a square.
+inline void to_octahedral(nirt::core::vector3df n, std::int16_t & x, std::int16_t & y)
+{
+	const utx::f32 sum = std::abs(n.X) + std::abs(n.Y) + std::abs(n.Z);
+	if (sum == 0)
+	{
+		x = y = 0;
+		return;
+	}
+	utx::f32 u = n.X / sum;
+	utx::f32 v = n.Y / sum;
+	if (n.Z < 0)
+	{
+		const utx::f32 fu = (1 - std::abs(v)) * (u >= 0 ? 1.0f : -1.0f);
+		const utx::f32 fv = (1 - std::abs(u)) * (v >= 0 ? 1.0f : -1.0f);
+		u = fu;
+		v = fv;
+	}
+	x = to_snorm16(u);
+	y = to_snorm16(v);
+}
+
+inline nirt::core::vector3df from_octahedral(std::int16_t x, std::int16_t y)
+{
+	nirt::core::vector3df n{from_snorm16(x), from_snorm16(y), 0};
+	n.Z = 1 - std::abs(n.X) - std::abs(n.Y);
+	const utx::f32 t = std::max(-n.Z, 0.0f);
+	n.X += n.X >= 0 ? -t : t;
+	n.Y += n.Y >= 0 ? -t : t;
+	return n.normalize();
+}
+
+} // namespace quantize
+
+////////////////////////////////////////////////////////////////////////
+// struct compact_buffer
+//
+// A mesh buffer of S3DVertex (36 bytes) stored in 14 bytes per vertex:
+// position as 16-bit fractions of the buffer's bounding box, the normal
+// octahedral encoded in two snorm16, and the texture coordinates as half
+// floats. A color shared by all vertices is stored once.
+//
+// The triangles are split into chunks of at most chunk_vertices vertices,
+// so a chunk can be decoded into a small fixed scratch array and drawn with
+// 16-bit indices local to the chunk. A vertex used by two chunks is stored
+// in both.
+
+struct compact_buffer
+{
+	constexpr static utx::u32 chunk_vertices = 8192;
+
+	struct packed_vertex
+	{
+		std::uint16_t position[3];
+		std::int16_t normal[2];
+		std::uint16_t tcoords[2];
+	};
+	struct chunk
+	{
+		utx::u32 first_vertex;
+		utx::u32 vertex_count;
+		utx::u32 first_index;
+		utx::u32 index_count;
+	};
+
+	nirt::core::vector3df origin;
+	nirt::core::vector3df scale;	// box extent / 65535
+	std::vector<packed_vertex> vertices;
+	std::vector<nirt::video::SColor> colors;	// empty when every vertex has `color`
+	nirt::video::SColor color;
+	std::vector<std::uint16_t> indices;	// relative to the first vertex of their chunk
+	std::vector<chunk> chunks;
+
+	std::uint64_t bytes() const
+	{
+		return vertices.size() * sizeof(packed_vertex) +
+			colors.size() * sizeof(nirt::video::SColor) +
+			indices.size() * sizeof(std::uint16_t) +
+			chunks.size() * sizeof(chunk);
+	}
+	// What one draw of the decoded buffer sends to the driver.
+	std::uint64_t draw_bytes() const
+	{
+		return vertices.size() * sizeof(nirt::video::S3DVertex) +
+			indices.size() * sizeof(std::uint16_t);
+	}
+
+	nirt::video::S3DVertex decode(std::size_t i) const
+	{
+		const packed_vertex & p = vertices[i];
+		nirt::video::S3DVertex v;
+		v.Pos.X = origin.X + p.position[0] * scale.X;
+		v.Pos.Y = origin.Y + p.position[1] * scale.Y;
+		v.Pos.Z = origin.Z + p.position[2] * scale.Z;
+		v.Normal = quantize::from_octahedral(p.normal[0], p.normal[1]);
+		v.Color = colors.empty() ? color : colors[i];
+		v.TCoords.X = quantize::from_half(p.tcoords[0]);
+		v.TCoords.Y = quantize::from_half(p.tcoords[1]);
+		return v;
+	}
+	// Into `out`, which holds at least c.vertex_count vertices.
+	void decode_chunk(const chunk & c, nirt::video::S3DVertex * out) const
+	{
+		for (utx::u32 i=0; i<c.vertex_count; i++)
+			out[i] = this->decode(c.first_vertex + i);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////
+// struct compact_error
+
+struct compact_error
+{
+	utx::f32 position = 0;	// largest distance, in mesh units
+	utx::f32 normal_degrees = 0;	// largest angle
+	utx::f32 tcoords = 0;	// largest difference of a coordinate
+};
+
+////////////////////////////////////////////////////////////////////////
+// class compact_store
+//
+// Optional (--compact-vertices): after loading, the vertices and indices of
+// static meshes are moved into compact buffers and the full-width arrays and
+// their hardware buffers are freed. The mesh buffers stay as they are
+// otherwise (material, bounding box), and scene_prep draws them through
+// draw(), which decodes one chunk at a time into a scratch array of at
+// most chunk_vertices vertices; that array is counted in the bytes after. The
+// saved memory is paid for with decoding on every draw, and with vertices
+// sent to the driver instead of staying in a hardware buffer. Animated
+// meshes are left alone, because their frames are rebuilt from full-width
+// data.
+
+class compact_store
+{
+protected:
+// data
+	bool __enabled;
+	nirt::video::IVideoDriver * __driver;
+
+	std::unordered_map<const nirt::scene::IMeshBuffer *, compact_buffer> __buffers;
+	std::unordered_map<const nirt::scene::IMesh *, std::vector<const nirt::scene::IMeshBuffer *>> __meshes;
+
+	std::uint64_t __bytes_before = 0;
+	std::uint64_t __bytes_after = 0;	// includes __scratch
+
+	std::vector<nirt::video::S3DVertex> __scratch;	// one decoded chunk
+
+	// Since the last take_stats().
+	utx::f64 __decode_ms = 0;
+	std::uint64_t __decoded_bytes = 0;
+	std::uint64_t __sent_bytes = 0;
+
+public:
+	struct draw_stats
+	{
+		utx::f64 decode_ms;
+		std::uint64_t decoded_bytes;
+		std::uint64_t sent_bytes;	// decoded vertices and indices handed to the driver
+	};
+
+public:
+// constructor
+	compact_store(nirt::NirtcppDevice * device, bool enabled):
+		__enabled{enabled},
+		__driver{device->getVideoDriver()}
+	{
+	}
+
+protected:
+// Removed
+	compact_store(const compact_store &) = delete;
+	compact_store & operator=(const compact_store &) = delete;
+
+protected:
+	static compact_buffer pack(const nirt::video::S3DVertex * vertices, utx::u32 vertex_count,
+		const void * indices, nirt::video::E_INDEX_TYPE index_type, utx::u32 index_count,
+		compact_error & error)
+	{
+		compact_buffer cb;
+
+		nirt::core::aabbox3df box{vertices[0].Pos};
+		for (utx::u32 i=1; i<vertex_count; i++)
+			box.addInternalPoint(vertices[i].Pos);
+		cb.origin = box.MinEdge;
+		cb.scale = box.getExtent() / 65535.0f;
+
+		auto fraction = [] (utx::f32 value, utx::f32 origin, utx::f32 scale) -> std::uint16_t
+		{
+			if (scale <= 0)
+				return 0;
+			return static_cast<std::uint16_t>(std::clamp<long>(std::lround((value - origin) / scale), 0, 65535));
+		};
+
+		// Split into chunks: a triangle goes into the current chunk, unless
+		// its new vertices would not fit any more.
+		std::vector<utx::u32> source;	// packed vertex -> original vertex
+		std::vector<utx::u32> chunk_of(vertex_count, ~0u);	// original vertex -> chunk it was last added to
+		std::vector<utx::u32> local(vertex_count);	// original vertex -> index within that chunk
+		auto index_at = [&] (utx::u32 i) -> utx::u32
+		{
+			return index_type == nirt::video::EIT_16BIT ?
+				static_cast<const std::uint16_t *>(indices)[i] : static_cast<const std::uint32_t *>(indices)[i];
+		};
+		cb.indices.reserve(index_count);
+		for (utx::u32 t=0; t+3<=index_count; t+=3)
+		{
+			const utx::u32 corner[3] = {index_at(t), index_at(t+1), index_at(t+2)};
+			auto current = static_cast<utx::u32>(cb.chunks.size()) - 1;
+			utx::u32 added = 0;
+			for (utx::u32 k=0; k<3; k++)
+			{
+				if (cb.chunks.empty() || chunk_of[corner[k]] != current)
+					added++;	// may count a repeated corner twice, which only closes a chunk early
+			}
+			if (cb.chunks.empty() || cb.chunks.back().vertex_count + added > compact_buffer::chunk_vertices)
+			{
+				cb.chunks.push_back({static_cast<utx::u32>(source.size()), 0, static_cast<utx::u32>(cb.indices.size()), 0});
+				current++;
+			}
+			compact_buffer::chunk & c = cb.chunks.back();
+			for (utx::u32 v: corner)
+			{
+				if (chunk_of[v] != current)
+				{
+					chunk_of[v] = current;
+					local[v] = c.vertex_count++;
+					source.push_back(v);
+				}
+				cb.indices.push_back(static_cast<std::uint16_t>(local[v]));
+			}
+			c.index_count += 3;
+		}
+
+		cb.color = vertices[0].Color;
+		bool one_color = true;
+		cb.vertices.resize(source.size());
+		for (std::size_t i=0; i<source.size(); i++)
+		{
+			const nirt::video::S3DVertex & v = vertices[source[i]];
+			compact_buffer::packed_vertex & p = cb.vertices[i];
+			p.position[0] = fraction(v.Pos.X, cb.origin.X, cb.scale.X);
+			p.position[1] = fraction(v.Pos.Y, cb.origin.Y, cb.scale.Y);
+			p.position[2] = fraction(v.Pos.Z, cb.origin.Z, cb.scale.Z);
+			quantize::to_octahedral(v.Normal, p.normal[0], p.normal[1]);
+			p.tcoords[0] = quantize::to_half(v.TCoords.X);
+			p.tcoords[1] = quantize::to_half(v.TCoords.Y);
+			one_color = one_color && v.Color == cb.color;
+		}
+		if (! one_color)
+		{
+			cb.colors.resize(source.size());
+			for (std::size_t i=0; i<source.size(); i++)
+				cb.colors[i] = vertices[source[i]].Color;
+		}
+
+		// Compare with the original.
+		for (std::size_t i=0; i<source.size(); i++)
+		{
+			const nirt::video::S3DVertex & v = vertices[source[i]];
+			const nirt::video::S3DVertex d = cb.decode(i);
+			error.position = std::max(error.position, v.Pos.getDistanceFrom(d.Pos));
+			nirt::core::vector3df n = v.Normal;
+			if (n.getLengthSQ() > 0)
+			{
+				const utx::f32 cos = std::clamp(n.normalize().dotProduct(d.Normal), -1.0f, 1.0f);
+				error.normal_degrees = std::max(error.normal_degrees, std::acos(cos) * 180 / std::numbers::pi_v<utx::f32>);
+			}
+			error.tcoords = std::max({error.tcoords,
+				std::abs(v.TCoords.X - d.TCoords.X), std::abs(v.TCoords.Y - d.TCoords.Y)});
+		}
+		return cb;
+	}
+
+	// Pack one buffer and free its full-width arrays. Only triangle lists of
+	// standard vertices in the two buffer types the mesh loaders create.
+	bool compact_buffer_of(nirt::scene::IMeshBuffer * mb, compact_error & error)
+	{
+		if (mb->getVertexType() != nirt::video::EVT_STANDARD || mb->getVertexCount() == 0)
+			return false;
+		if (mb->getPrimitiveType() != nirt::scene::EPT_TRIANGLES || mb->getIndexCount() < 3)
+			return false;
+
+		auto * standard = dynamic_cast<nirt::scene::SMeshBuffer *>(mb);
+		auto * dynamic = dynamic_cast<nirt::scene::IDynamicMeshBuffer *>(mb);
+		if (! standard && ! dynamic)
+			return false;
+
+		const std::uint64_t before = static_cast<std::uint64_t>(mb->getVertexCount()) * sizeof(nirt::video::S3DVertex) +
+			static_cast<std::uint64_t>(mb->getIndexCount()) * (mb->getIndexType() == nirt::video::EIT_16BIT ? 2 : 4);
+
+		compact_buffer cb = pack(
+			static_cast<const nirt::video::S3DVertex *>(mb->getVertices()),
+			mb->getVertexCount(),
+			mb->getIndices(),
+			mb->getIndexType(),
+			mb->getIndexCount(),
+			error
+		);
+		// Triangles scattered over the whole buffer store so many vertices in
+		// several chunks that nothing would be saved.
+		if (cb.bytes() >= before)
+			return false;
+
+		// The bounding box stays, culling and sorting still use it.
+		__driver->removeHardwareBuffer(mb);
+		mb->setHardwareMappingHint(nirt::scene::EHM_NEVER, nirt::scene::EBT_VERTEX_AND_INDEX);
+		if (standard)
+		{
+			standard->Vertices.clear();
+			standard->Indices.clear();
+		}
+		else
+		{
+			dynamic->getVertexBuffer().set_used(0);
+			dynamic->getVertexBuffer().reallocate(0);
+			dynamic->getIndexBuffer().set_used(0);
+			dynamic->getIndexBuffer().reallocate(0);
+		}
+
+		__bytes_before += before;
+		__bytes_after += cb.bytes();
+		for (const compact_buffer::chunk & c: cb.chunks)
+		{
+			if (c.vertex_count > __scratch.size())
+			{
+				__bytes_after += (c.vertex_count - __scratch.size()) * sizeof(nirt::video::S3DVertex);
+				__scratch.resize(c.vertex_count);
+			}
+		}
+		__buffers.emplace(mb, std::move(cb));
+		return true;
+	}
+
+public:
+	void compact(nirt::scene::IAnimatedMesh * animated, std::string_view name)
+	{
+		if (! __enabled || __meshes.contains(animated))
+			return;
+		if (animated->getFrameCount() > 1 || animated->getMeshType() == nirt::scene::EAMT_SKINNED)
+			return;
+		nirt::scene::IMesh * mesh = animated->getMesh(0);
+
+		const std::uint64_t before = __bytes_before;
+		const std::uint64_t after = __bytes_after;
+		compact_error error;
+		std::vector<const nirt::scene::IMeshBuffer *> & packed = __meshes[animated];
+		std::uint64_t vertices = 0;
+		std::uint64_t draw_bytes = 0;
+		for (utx::u32 i=0; i<mesh->getMeshBufferCount(); i++)
+		{
+			nirt::scene::IMeshBuffer * mb = mesh->getMeshBuffer(i);
+			if (! this->compact_buffer_of(mb, error))
+				continue;
+			packed.push_back(mb);
+			vertices += __buffers.at(mb).vertices.size();
+			draw_bytes += __buffers.at(mb).draw_bytes();
+		}
+		if (packed.empty())
+			return;
+
+		log_info("compact vertices:", name, "| bytes", __bytes_before - before,
+			"->", __bytes_after - after, "| max error: position", error.position);
+		log_info("compact vertices:", name, "| every cell in view: decode", vertices,
+			"vertices, send", draw_bytes, "bytes");
+		log_info("compact vertices:", name, "| max error: normal degrees", error.normal_degrees,
+			"| tcoords", error.tcoords);
+		log_info("compact vertices: all meshes | bytes", __bytes_before, "->", __bytes_after,
+			"| decode scratch", __scratch.size() * sizeof(nirt::video::S3DVertex), "bytes of those");
+	}
+
+	// The mesh is going away; its buffers may be reused by a new mesh.
+	void forget(const nirt::scene::IAnimatedMesh * animated)
+	{
+		auto itr = __meshes.find(animated);
+		if (itr == __meshes.end())
+			return;
+		for (const nirt::scene::IMeshBuffer * mb: itr->second)
+			__buffers.erase(mb);
+		__meshes.erase(itr);
+	}
+
+	// Safe to call from several threads while nothing is compacted or forgotten.
+	const compact_buffer * find(const nirt::scene::IMeshBuffer * mb) const
+	{
+		if (__buffers.empty())
+			return nullptr;
+		auto itr = __buffers.find(mb);
+		return itr == __buffers.end() ? nullptr : &itr->second;
+	}
+
+	// Decode and draw with the current material and transforms, one chunk
+	// at a time. Main thread.
+	void draw(const compact_buffer & cb)
+	{
+		for (const compact_buffer::chunk & c: cb.chunks)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			cb.decode_chunk(c, __scratch.data());
+			__decode_ms += std::chrono::duration<utx::f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			__driver->drawVertexPrimitiveList(
+				__scratch.data(),
+				c.vertex_count,
+				cb.indices.data() + c.first_index,
+				c.index_count / 3,
+				nirt::video::EVT_STANDARD,
+				nirt::scene::EPT_TRIANGLES,
+				nirt::video::EIT_16BIT
+			);
+		}
+		__decoded_bytes += cb.vertices.size() * sizeof(nirt::video::S3DVertex);
+		__sent_bytes += cb.draw_bytes();
+	}
+
+	// The cost of draw() since the last call.
+	draw_stats take_stats()
+	{
+		const draw_stats stats{__decode_ms, __decoded_bytes, __sent_bytes};
+		__decode_ms = 0;
+		__decoded_bytes = 0;
+		__sent_bytes = 0;
+		return stats;
+	}
+}; // class compact_store
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_compact_mesh_hpp__
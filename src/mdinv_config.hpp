@@ -13,6 +13,7 @@
 #include <nirtcpp.hpp>
 #include <filesystem>
 #include <fstream>
+#include <cstdlib>
 
 namespace fs = std::filesystem;
 
@@ -37,6 +38,8 @@ protected:
 	utx::u32 __splitx = 2;
 	utx::u32 __splity = 2;
 
+	std::string_view __socket_name = "mdinv-3d-viewer.sock";	// in $XDG_RUNTIME_DIR
+
 	std::string_view __description = 
 R"(Mdinv 3D Viewer is a 3D mesh viewer for irrlicht and nirtcpp mesh formats.
 It will help you develop 3D applications using irrlicht or nirtcpp.)";
@@ -144,6 +147,15 @@ public:
 	std::wstring_view title() const {return __title;}
 	std::string_view description() const {return __description;}
 	std::string_view license() const {return __license;}
+	// Empty without XDG_RUNTIME_DIR: a shared directory like /tmp would let
+	// another user take the path first.
+	std::string socket_path() const
+	{
+		const char * dir = std::getenv("XDG_RUNTIME_DIR");
+		if (! dir || ! *dir)
+			return {};
+		return (fs::path{dir} / __socket_name).string();
+	}
 }; // class application_init_info
 const application_init_info application_init_info::__instance{};
 
@@ -0,0 +1,514 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_content_cache_hpp__
+#define __mdinv_src_mdinv_content_cache_hpp__
+
+#include <mdinv_config.hpp>
+#include <mdinv_compact_mesh.hpp>
+#include <mdinv_content_hash.hpp>
+#include <mdinv_log.hpp>
+
+#include <nirtcpp.hpp>
+#include <utxcpp/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// struct load_report
+
+struct load_report
+{
+	utx::u32 meshes_loaded = 0;
+	utx::u32 meshes_shared = 0;
+	utx::u32 textures_shared = 0;
+	std::uint64_t bytes_saved = 0;
+	utx::f64 ms_saved = 0;	// mesh parsing
+	utx::f64 texture_ms_saved = 0;	// texture decoding
+
+	void print() const
+	{
+		log_info(
+			"load report: meshes loaded", meshes_loaded,
+			"| meshes shared", meshes_shared,
+			"| textures shared", textures_shared
+		);
+		log_info(
+			"load report: dedup saved", bytes_saved,
+			"bytes | mesh parse ms", ms_saved, "| texture decode ms", texture_ms_saved
+		);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////
+// class content_cache
+//
+// The scene manager's mesh cache is keyed by file name, so byte-identical
+// copies under different names are parsed and uploaded again. This cache is
+// keyed by file content and hands out the mesh or texture decoded first.
+
+class content_cache
+{
+public:
+	// One material texture layer of a cached mesh.
+	struct texture_slot
+	{
+		nirt::scene::IAnimatedMesh * mesh;
+		utx::u32 buffer;
+		utx::u32 layer;
+	};
+
+protected:
+	struct mesh_entry
+	{
+		nirt::scene::IAnimatedMesh * mesh = nullptr;
+		utx::f64 load_ms = 0;
+		std::uint64_t mesh_bytes = 0;
+	};
+	struct texture_entry
+	{
+		nirt::video::ITexture * texture = nullptr;
+		std::uint64_t texture_bytes = 0;
+		utx::f64 decode_ms = 0;
+	};
+	struct texture_file
+	{
+		std::string name;	// as the mesh loader named the texture
+		std::vector<texture_slot> slots;
+	};
+
+	// Asked before the built-in image loaders while a mesh is parsed. Content
+	// the cache already has a texture for is not decoded: the mesh gets a 1x1
+	// placeholder, which share_textures() then swaps for the cached texture.
+	// Other content is decoded by the built-in loaders from here, to time it.
+	class texture_loader: public nirt::video::IImageLoader
+	{
+	public:
+		struct file_record
+		{
+			content_digest digest;
+			utx::f64 decode_ms = 0;
+		};
+
+		content_cache * cache = nullptr;	// null once the cache is gone
+		mutable bool decoding = false;	// inside the driver's own loaders
+		// file name, as the texture is named after it -> what this loader found
+		mutable std::unordered_map<std::string, file_record> files;
+
+	public:
+		bool isALoadableFileExtension(const nirt::io::path &) const override
+		{
+			return cache && cache->__parsing && ! decoding;
+		}
+		bool isALoadableFileFormat(nirt::io::IReadFile *) const override
+		{
+			return cache && cache->__parsing && ! decoding;
+		}
+		nirt::video::IImage * loadImage(nirt::io::IReadFile * file) const override
+		{
+			std::vector<char> bytes(static_cast<std::size_t>(std::max(file->getSize(), 0l)));
+			if (file->read(bytes.data(), bytes.size()) != bytes.size())
+				return nullptr;
+			content_hash hash;
+			hash.update(bytes.data(), bytes.size());
+			file_record & record = files[file->getFileName().c_str()];
+			record.digest = hash.digest();
+
+			if (cache->__textures.contains(record.digest))
+			{
+				nirt::video::IImage * placeholder = cache->__driver->createImage(
+					nirt::video::ECF_A8R8G8B8, nirt::core::dimension2du{1, 1});
+				if (placeholder)
+				{
+					placeholder->fill(nirt::video::SColor{0xffffffff});
+					return placeholder;
+				}
+			}
+
+			const auto start = std::chrono::steady_clock::now();
+			file->seek(0);
+			decoding = true;
+			nirt::video::IImage * image = cache->__driver->createImageFromFile(file);
+			decoding = false;
+			record.decode_ms = std::chrono::duration<utx::f64, std::milli>(
+				std::chrono::steady_clock::now() - start
+			).count();
+			return image;
+		}
+	};
+
+protected:
+// data
+	nirt::scene::ISceneManager * __smgr;
+	nirt::video::IVideoDriver * __driver;
+	nirt::io::IFileSystem * __fs;
+	compact_store * __compact;	// optional
+
+	texture_loader * __loader;
+	bool __parsing = false;	// a mesh is being parsed, __loader is on
+
+	std::unordered_map<content_digest, mesh_entry, content_digest_hasher> __meshes;
+	std::unordered_map<content_digest, texture_entry, content_digest_hasher> __textures;
+	// texture pointer -> digest, so a texture already checked is not hashed again.
+	std::unordered_map<nirt::video::ITexture *, content_digest> __texture_digests;
+	// canonical mesh file name -> digest of what was last loaded from it.
+	std::unordered_map<std::string, content_digest> __names;
+	// canonical texture file name -> the slots loaded from it. A shared texture
+	// stands for several files, so it is split again when one of them changes.
+	std::unordered_map<std::string, texture_file> __texture_files;
+
+	load_report __report;
+
+public:
+// constructor
+	content_cache(nirt::NirtcppDevice * device, compact_store * compact = nullptr):
+		__smgr{device->getSceneManager()},
+		__driver{device->getVideoDriver()},
+		__fs{device->getFileSystem()},
+		__compact{compact},
+		__loader{new texture_loader}
+	{
+		__loader->cache = this;
+		// Added last, so the driver asks it first.
+		__driver->addExternalImageLoader(__loader);
+	}
+// destructor
+	virtual ~content_cache()
+	{
+		for (auto & [digest, entry]: __meshes)
+			entry.mesh->drop();
+		// The driver holds it as long as it lives.
+		__loader->cache = nullptr;
+		__loader->drop();
+	}
+
+protected:
+// Removed
+	content_cache(const content_cache &) = delete;
+	content_cache & operator=(const content_cache &) = delete;
+
+protected:
+	static std::uint64_t mesh_bytes(nirt::scene::IMesh * mesh)
+	{
+		std::uint64_t bytes = 0;
+		for (utx::u32 i=0; i<mesh->getMeshBufferCount(); i++)
+		{
+			nirt::scene::IMeshBuffer * mb = mesh->getMeshBuffer(i);
+			bytes += static_cast<std::uint64_t>(mb->getVertexCount()) *
+				nirt::video::getVertexPitchFromType(mb->getVertexType());
+			bytes += static_cast<std::uint64_t>(mb->getIndexCount()) *
+				(mb->getIndexType() == nirt::video::EIT_16BIT ? 2 : 4);
+		}
+		return bytes;
+	}
+	static std::uint64_t texture_bytes(nirt::video::ITexture * texture)
+	{
+		return static_cast<std::uint64_t>(texture->getPitch()) * texture->getSize().Height;
+	}
+
+	static nirt::video::ITexture * texture_of(const texture_slot & slot)
+	{
+		return slot.mesh->getMeshBuffer(slot.buffer)->getMaterial().getTexture(slot.layer);
+	}
+
+	// Point every material layer of `mesh` that uses `from` at `to` instead.
+	static void replace_texture(nirt::scene::IMesh * mesh,
+		nirt::video::ITexture * from, nirt::video::ITexture * to)
+	{
+		for (utx::u32 i=0; i<mesh->getMeshBufferCount(); i++)
+		{
+			nirt::video::SMaterial & material = mesh->getMeshBuffer(i)->getMaterial();
+			for (utx::u32 t=0; t<nirt::video::MATERIAL_MAX_TEXTURES; t++)
+			{
+				if (material.getTexture(t) == from)
+					material.setTexture(t, to);
+			}
+		}
+	}
+
+	void share_textures(nirt::scene::IAnimatedMesh * mesh)
+	{
+		std::vector<nirt::video::ITexture *> seen;
+		for (utx::u32 i=0; i<mesh->getMeshBufferCount(); i++)
+		{
+			const nirt::video::SMaterial & material = mesh->getMeshBuffer(i)->getMaterial();
+			for (utx::u32 t=0; t<nirt::video::MATERIAL_MAX_TEXTURES; t++)
+			{
+				nirt::video::ITexture * texture = material.getTexture(t);
+				if (! texture)
+					continue;
+				const std::string name = texture->getName().getPath().c_str();
+				if (! fs::is_regular_file(name))
+					continue;
+				// Before sharing: the slot came from this file, whatever it shows later.
+				texture_file & file = __texture_files[fs::weakly_canonical(name).string()];
+				file.name = name;
+				file.slots.push_back({mesh, i, t});
+				if (std::ranges::find(seen, texture) == seen.end())
+					seen.push_back(texture);
+			}
+		}
+
+		for (nirt::video::ITexture * texture: seen)
+		{
+			if (__texture_digests.contains(texture))
+				continue;
+			// Hashed by __loader while parsing, or else from its file.
+			const std::string name = texture->getName().getPath().c_str();
+			content_digest digest;
+			utx::f64 decode_ms = 0;
+			if (auto record = __loader->files.find(name); record != __loader->files.end())
+			{
+				digest = record->second.digest;
+				decode_ms = record->second.decode_ms;
+			}
+			else if (fs::is_regular_file(name))
+				digest = content_hash::file(name);
+			else
+				continue;
+
+			auto [itr, inserted] = __textures.try_emplace(digest, texture_entry{texture, texture_bytes(texture), decode_ms});
+			if (inserted || itr->second.texture == texture)
+			{
+				__texture_digests[texture] = digest;
+				continue;
+			}
+
+			// Same content as a texture we already have: share it and free the
+			// placeholder, or the copy if it was decoded before __loader saw it.
+			replace_texture(mesh, texture, itr->second.texture);
+			__driver->removeTexture(texture);
+			__report.textures_shared++;
+			__report.bytes_saved += itr->second.texture_bytes;
+			__report.texture_ms_saved += itr->second.decode_ms;
+		}
+	}
+
+	// `name` now has other content; forget the mesh it had unless another
+	// name still refers to it.
+	void release_name(const std::string & name)
+	{
+		auto itr = __names.find(name);
+		if (itr == __names.end())
+			return;
+		const content_digest old = itr->second;
+		__names.erase(itr);
+		for (const auto & [other, digest]: __names)
+		{
+			if (digest == old)
+				return;
+		}
+		if (auto entry = __meshes.find(old); entry != __meshes.end())
+		{
+			nirt::scene::IAnimatedMesh * mesh = entry->second.mesh;
+			for (auto & [file, record]: __texture_files)
+				std::erase_if(record.slots, [mesh] (const texture_slot & slot) {return slot.mesh == mesh;});
+			std::erase_if(__texture_files, [] (const auto & item) {return item.second.slots.empty();});
+			if (__compact)
+				__compact->forget(mesh);
+			mesh->drop();
+			__meshes.erase(entry);
+		}
+	}
+
+public:
+	// Load a mesh, sharing the already decoded one if a file with the same
+	// content was loaded before. Returns nullptr if the mesh can not be loaded.
+	nirt::scene::IAnimatedMesh * load_mesh(const std::wstring_view filename)
+	{
+		const fs::path path = fs::weakly_canonical(fs::path{filename});
+		std::vector<char> bytes;
+		const content_digest digest = content_hash::file(path, &bytes);
+		return this->load_mesh(path, bytes, digest);
+	}
+
+	// Same, with the file already read and hashed by the caller. `path` is canonical.
+	nirt::scene::IAnimatedMesh * load_mesh(const fs::path & path, std::vector<char> & bytes, const content_digest & digest)
+	{
+		const std::string name = path.string();
+		if (auto itr = __names.find(name); itr != __names.end() && itr->second != digest)
+			this->release_name(name);
+
+		if (auto itr = __meshes.find(digest); itr != __meshes.end())
+		{
+			__names[name] = digest;
+			__report.meshes_shared++;
+			__report.bytes_saved += itr->second.mesh_bytes;	// the file was still read to hash it
+			__report.ms_saved += itr->second.load_ms;
+			__report.print();
+			return itr->second.mesh;
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+
+		// The scene manager would return what it cached under this name, which
+		// has different content by now.
+		nirt::scene::IMeshCache * name_cache = __smgr->getMeshCache();
+		if (nirt::scene::IAnimatedMesh * stale = name_cache->getMeshByName(name.data()))
+			name_cache->removeMesh(stale);
+
+		// Parse from the bytes the hash pass already read.
+		nirt::io::IReadFile * file = __fs->createMemoryReadFile(
+			bytes.data(),
+			static_cast<utx::i32>(bytes.size()),
+			name.data(),
+			false		// memory is owned by `bytes`
+		);
+		if (! file)
+			return nullptr;
+		__loader->files.clear();
+		__parsing = true;
+		nirt::scene::IAnimatedMesh * mesh = __smgr->getMesh(file);
+		__parsing = false;
+		file->drop();
+		if (! mesh)
+			return nullptr;
+
+		this->share_textures(mesh);
+
+		const utx::f64 load_ms = std::chrono::duration<utx::f64, std::milli>(
+			std::chrono::steady_clock::now() - start
+		).count();
+
+		mesh->grab();
+		__meshes[digest] = mesh_entry{mesh, load_ms, mesh_bytes(mesh)};
+		__names[name] = digest;
+		if (__compact)
+			__compact->compact(mesh, name);
+		__report.meshes_loaded++;
+		__report.print();
+		return mesh;
+	}
+
+	struct texture_swap
+	{
+		nirt::video::ITexture * from = nullptr;	// grabbed, the caller drops it
+		nirt::video::ITexture * to = nullptr;
+		std::vector<texture_slot> slots;	// now showing `to`
+	};
+
+	// Decode changed texture file content and put it in the slots of cached
+	// meshes loaded from `path`. Slots of other files sharing the old texture
+	// keep it. Scene nodes keep their own copy of the materials, so the caller
+	// fixes those and then drops `from`.
+	texture_swap reload_texture(const fs::path & path, std::vector<char> & bytes, const content_digest & digest)
+	{
+		auto file = __texture_files.find(path.string());
+		if (file == __texture_files.end())
+			return {};
+		const texture_file & record = file->second;
+		nirt::video::ITexture * from = texture_of(record.slots.front());
+		if (! from)
+			return {};
+		// Keep the name the mesh loader gave it, so later loads find it.
+		const std::string & name = record.name;
+
+		nirt::io::IReadFile * read_file = __fs->createMemoryReadFile(
+			bytes.data(),
+			static_cast<utx::i32>(bytes.size()),
+			name.data(),
+			false
+		);
+		if (! read_file)
+			return {};
+		nirt::video::IImage * image = __driver->createImageFromFile(read_file);
+		read_file->drop();
+		if (! image)
+			return {};
+		// Under a temporary name: two textures with one name confuse findTexture().
+		nirt::video::ITexture * to = __driver->addTexture((name + "?reload").data(), image);
+		image->drop();
+		if (! to)
+			return {};
+
+		// Another file whose slots still show the old texture.
+		const texture_file * other = nullptr;
+		for (const auto & [other_path, other_record]: __texture_files)
+		{
+			if (&other_record != &record && std::ranges::any_of(other_record.slots,
+				[from] (const texture_slot & slot) {return texture_of(slot) == from;}))
+			{
+				other = &other_record;
+				break;
+			}
+		}
+
+		from->grab();
+		if (name == from->getName().getPath().c_str())
+		{
+			if (other)
+				__driver->renameTexture(from, other->name.data());
+			else
+				__driver->removeTexture(from);
+		}
+		__driver->renameTexture(to, name.data());
+
+		for (const texture_slot & slot: record.slots)
+			slot.mesh->getMeshBuffer(slot.buffer)->getMaterial().setTexture(slot.layer, to);
+
+		if (! other)
+		{
+			if (auto itr = __texture_digests.find(from); itr != __texture_digests.end())
+			{
+				if (auto entry = __textures.find(itr->second); entry != __textures.end() && entry->second.texture == from)
+					__textures.erase(entry);
+				__texture_digests.erase(itr);
+			}
+		}
+		__textures.try_emplace(digest, texture_entry{to, texture_bytes(to)});
+		__texture_digests[to] = digest;
+		return {from, to, record.slots};
+	}
+
+	// The mesh file loaded under `path` and the texture files it uses, with
+	// their digests, for watching them.
+	std::vector<std::pair<fs::path, content_digest>> sources(const fs::path & path) const
+	{
+		std::vector<std::pair<fs::path, content_digest>> result;
+		auto name = __names.find(path.string());
+		if (name == __names.end())
+			return result;
+		result.emplace_back(path, name->second);
+
+		nirt::scene::IAnimatedMesh * mesh = __meshes.at(name->second).mesh;
+		for (const auto & [file, record]: __texture_files)
+		{
+			for (const texture_slot & slot: record.slots)
+			{
+				if (slot.mesh != mesh)
+					continue;
+				if (auto itr = __texture_digests.find(texture_of(slot)); itr != __texture_digests.end())
+					result.emplace_back(file, itr->second);
+				break;
+			}
+		}
+		return result;
+	}
+
+	// Whether a cached mesh uses a texture loaded from the canonical `path`.
+	bool has_texture_file(const fs::path & path) const
+	{
+		return __texture_files.contains(path.string());
+	}
+
+public:
+// get
+	const load_report & report() const
+	{
+		return __report;
+	}
+}; // class content_cache
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_content_cache_hpp__
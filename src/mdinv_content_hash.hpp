@@ -0,0 +1,179 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_content_hash_hpp__
+#define __mdinv_src_mdinv_content_hash_hpp__
+
+#include <mdinv_config.hpp>
+
+#include <utxcpp/core.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// struct content_digest
+
+struct content_digest
+{
+	std::uint64_t hash = 0;
+	std::uint64_t size = 0;
+
+	bool operator==(const content_digest &) const = default;
+};
+
+struct content_digest_hasher
+{
+	std::size_t operator()(const content_digest & digest) const
+	{
+		return static_cast<std::size_t>(digest.hash ^ (digest.size * 0x9e3779b97f4a7c15ull));
+	}
+};
+
+////////////////////////////////////////////////////////////////////////
+// class content_hash
+//
+// Streaming 64-bit hash, 8 bytes per step, finished with the murmur3 mixer.
+// Not cryptographic: only used to find byte-identical asset files.
+
+class content_hash
+{
+protected:
+// data
+	constexpr static std::uint64_t __prime = 0x9fb21c651e98df25ull;
+	constexpr static std::size_t __chunk_size = 1 << 20;
+
+	std::uint64_t __state = 0xcbf29ce484222325ull;
+	std::uint64_t __size = 0;
+
+protected:
+	static std::uint64_t rotl(std::uint64_t x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+	static std::uint64_t fmix(std::uint64_t x)
+	{
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+public:
+	// Feed a block; blocks must be multiples of 8 bytes except the last one.
+	void update(const char * data, std::size_t count)
+	{
+		std::size_t i = 0;
+		for (; i+8 <= count; i += 8)
+		{
+			std::uint64_t word;
+			std::memcpy(&word, data+i, 8);
+			__state = rotl(__state ^ (word * __prime), 31) * __prime;
+		}
+		if (i < count)
+		{
+			std::uint64_t word = 0;
+			std::memcpy(&word, data+i, count-i);
+			__state = rotl(__state ^ (word * __prime), 27) * __prime;
+		}
+		__size += count;
+	}
+	content_digest digest() const
+	{
+		return {fmix(__state ^ __size), __size};
+	}
+
+public:
+	// Hash a whole file. If `keep` is not null, the file is read straight into
+	// it by one reader thread and hashed right behind the reader, and the bytes
+	// are left there so the caller does not have to read the file a second
+	// time. Without `keep` there is nothing to overlap with, so one buffer is
+	// read and hashed in turn.
+	static content_digest file(const fs::path & path, std::vector<char> * keep = nullptr)
+	{
+		std::ifstream file{path, std::ios::binary};
+		if (! file)
+			throw std::runtime_error{"can not open " + path.string()};
+
+		std::error_code ec;
+		const auto total = fs::file_size(path, ec);
+		content_hash hash;
+		if (! keep || ec)
+		{
+			if (keep)
+				keep->clear();
+			std::vector<char> buf(__chunk_size);
+			while (file.read(buf.data(), static_cast<std::streamsize>(buf.size())) || file.gcount() > 0)
+			{
+				const auto count = static_cast<std::size_t>(file.gcount());
+				hash.update(buf.data(), count);
+				if (keep)
+					keep->insert(keep->end(), buf.begin(), buf.begin() + count);
+			}
+			return hash.digest();
+		}
+
+		// Bytes read so far, with the top bit set once the reader is done.
+		// Partial chunks are only published at the end: update() must see the
+		// same 8 byte steps however the file was split.
+		constexpr std::uint64_t done = 1ull << 63;
+		std::atomic<std::uint64_t> progress = 0;
+
+		keep->resize(total);
+		std::jthread reader{[&]
+		{
+			std::size_t count = 0;
+			while (count < keep->size())
+			{
+				const std::size_t want = std::min(__chunk_size, keep->size() - count);
+				file.read(keep->data() + count, static_cast<std::streamsize>(want));
+				count += static_cast<std::size_t>(file.gcount());
+				if (static_cast<std::size_t>(file.gcount()) < want)
+					break;	// shrunk since file_size()
+				if (count < keep->size())
+				{
+					progress.store(count, std::memory_order_release);
+					progress.notify_one();
+				}
+			}
+			progress.store(count | done, std::memory_order_release);
+			progress.notify_one();
+		}};
+
+		std::size_t hashed = 0;
+		while (true)
+		{
+			const std::uint64_t seen = progress.load(std::memory_order_acquire);
+			const std::size_t count = static_cast<std::size_t>(seen & ~done);
+			if (count > hashed)
+			{
+				hash.update(keep->data() + hashed, count - hashed);
+				hashed = count;
+			}
+			if (seen & done)
+				break;
+			progress.wait(seen, std::memory_order_acquire);
+		}
+		reader.join();
+		keep->resize(hashed);
+		return hash.digest();
+	}
+}; // class content_hash
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_content_hash_hpp__
@@ -9,6 +9,7 @@
 #define __mdinv_src_mdinv_gui_hpp__
 
 #include <mdinv_config.hpp>
+#include <mdinv_log.hpp>
 
 #include <nirtcpp.hpp>
 #include <utxcpp/core.hpp>
@@ -34,7 +35,7 @@ auto setup_font = [] (nirt::NirtcppDevice * device, nirt::gui::IGUIEnvironment *
 		}
 	}
 	if (! font)
-		utx::printe("---- Font File Not Found:", font_name, "----");
+		log_error("---- Font File Not Found:", font_name, "----");
 };
 
 auto create_menu = [](nirt::NirtcppDevice * device, nirt::gui::IGUIEnvironment * ngui)
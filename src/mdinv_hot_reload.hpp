@@ -0,0 +1,229 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_hot_reload_hpp__
+#define __mdinv_src_mdinv_hot_reload_hpp__
+
+#include <mdinv_config.hpp>
+#include <mdinv_content_hash.hpp>
+#include <mdinv_log.hpp>
+
+#include <utxcpp/core.hpp>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// class hot_reload
+//
+// Watches the directories of loaded mesh and texture files with inotify.
+// Editors often save in several steps (truncate, write, rename), so a file
+// is only looked at once it has been quiet for a while. It is then read and
+// hashed on the watcher thread, and handed to the GUI thread with take() if
+// its content really changed. Decoding stays on the GUI thread, which owns
+// the device.
+
+class hot_reload
+{
+public:
+	struct job
+	{
+		fs::path path;
+		std::vector<char> bytes;
+		content_digest digest;
+		std::chrono::steady_clock::time_point changed;	// last write seen
+	};
+
+protected:
+// data
+	constexpr static std::chrono::milliseconds __debounce{200};
+
+	int __fd = -1;
+
+	std::mutex __mutex;
+	std::unordered_map<int, fs::path> __dirs;	// watch descriptor -> directory
+	std::unordered_map<std::string, content_digest> __files;	// watched file -> last digest
+	std::vector<job> __ready;
+
+	// Watcher thread only: file -> time of its last event.
+	std::unordered_map<std::string, std::chrono::steady_clock::time_point> __pending;
+
+	std::jthread __watcher;
+
+public:
+// constructor
+	hot_reload()
+	{
+		__fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (__fd < 0)
+		{
+			log_warn("inotify is not available, hot reload is off");
+			return;
+		}
+		__watcher = std::jthread{[this] (std::stop_token stop) {this->watch_loop(stop);}};
+	}
+// destructor
+	virtual ~hot_reload()
+	{
+		if (__watcher.joinable())
+		{
+			__watcher.request_stop();
+			__watcher.join();
+		}
+		if (__fd >= 0)
+			::close(__fd);
+	}
+
+protected:
+// Removed
+	hot_reload(const hot_reload &) = delete;
+	hot_reload & operator=(const hot_reload &) = delete;
+
+protected:
+	void read_events()
+	{
+		alignas(inotify_event) char buffer[4096];
+		while (true)
+		{
+			const ssize_t n = ::read(__fd, buffer, sizeof(buffer));
+			if (n <= 0)
+				return;
+			const auto now = std::chrono::steady_clock::now();
+			std::lock_guard lock{__mutex};
+			for (ssize_t offset = 0; offset < n;)
+			{
+				const auto * event = reinterpret_cast<const inotify_event *>(buffer + offset);
+				offset += sizeof(inotify_event) + event->len;
+				if (event->len == 0)
+					continue;
+				auto dir = __dirs.find(event->wd);
+				if (dir == __dirs.end())
+					continue;
+				const std::string file = (dir->second / event->name).string();
+				if (__files.contains(file))
+					__pending[file] = now;
+			}
+		}
+	}
+
+	void watch_loop(std::stop_token stop)
+	{
+		while (! stop.stop_requested())
+		{
+			pollfd pfd{__fd, POLLIN, 0};
+			if (::poll(&pfd, 1, 50) > 0)
+				this->read_events();
+
+			const auto now = std::chrono::steady_clock::now();
+			for (auto itr = __pending.begin(); itr != __pending.end();)
+			{
+				if (now - itr->second < __debounce)
+				{
+					++itr;
+					continue;
+				}
+				job ready{itr->first, {}, {}, itr->second};
+				itr = __pending.erase(itr);
+				try
+				{
+					ready.digest = content_hash::file(ready.path, &ready.bytes);
+				}
+				catch (const std::exception & err)
+				{
+					// Gone for now (renamed away mid-save); the next event brings it back.
+					log_debug("hot reload:", err.what());
+					continue;
+				}
+
+				std::lock_guard lock{__mutex};
+				auto known = __files.find(ready.path.string());
+				if (known == __files.end())
+					continue;	// no longer watched
+				if (known->second == ready.digest)
+					continue;	// saved without changes
+				known->second = ready.digest;
+				__ready.push_back(std::move(ready));
+			}
+		}
+	}
+
+public:
+	// Watch a canonical file path whose current content has `digest`.
+	void watch(const fs::path & file, const content_digest & digest)
+	{
+		if (__fd < 0)
+			return;
+		std::lock_guard lock{__mutex};
+		if (__files.contains(file.string()))
+			return;
+		__files[file.string()] = digest;
+
+		const fs::path dir = file.parent_path();
+		for (const auto & [wd, watched]: __dirs)
+		{
+			if (watched == dir)
+				return;
+		}
+		const int wd = ::inotify_add_watch(__fd, dir.string().data(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0)
+		{
+			log_warn("can not watch", dir);
+			return;
+		}
+		__dirs[wd] = dir;
+	}
+
+	// Stop watching a file; its directory too once no other file there is watched.
+	void unwatch(const fs::path & file)
+	{
+		if (__fd < 0)
+			return;
+		std::lock_guard lock{__mutex};
+		if (! __files.erase(file.string()))
+			return;
+
+		const fs::path dir = file.parent_path();
+		for (const auto & [other, digest]: __files)
+		{
+			if (fs::path{other}.parent_path() == dir)
+				return;
+		}
+		for (auto itr = __dirs.begin(); itr != __dirs.end(); ++itr)
+		{
+			if (itr->second == dir)
+			{
+				::inotify_rm_watch(__fd, itr->first);
+				__dirs.erase(itr);
+				return;
+			}
+		}
+	}
+
+	// Changed files, oldest first; called on the GUI thread.
+	std::vector<job> take()
+	{
+		std::lock_guard lock{__mutex};
+		std::vector<job> result;
+		result.swap(__ready);
+		return result;
+	}
+}; // class hot_reload
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_hot_reload_hpp__
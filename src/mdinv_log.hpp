@@ -0,0 +1,644 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_log_hpp__
+#define __mdinv_src_mdinv_log_hpp__
+
+#include <utxcpp/core.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// Logging
+//
+// A message is not formatted by the thread logging it. Its arguments are
+// encoded straight into the next record of a ring buffer owned by that
+// thread (one producer, one consumer, no lock), and string arguments are
+// copied into a byte arena of the same ring, so logging does not allocate.
+// The record is stamped with the TSC on x86, which costs a few nanoseconds
+// instead of a clock call. A background thread drains all rings, orders the
+// records by time and formats them to the console, and writes them to the
+// binary log file if one is open.
+//
+// String arguments are copied, including char arrays: a local buffer may be
+// gone by the time the flush thread formats the record. A string is cut at
+// log_ring::max_text bytes. When a ring or its arena is full the producer
+// waits for the flush thread, so no message is dropped.
+
+enum class log_level: utx::u8
+{
+	debug,
+	info,
+	warn,
+	error,
+	off
+};
+
+auto parse_log_level = [] (std::string_view name) -> std::optional<log_level>
+{
+	if (name == "debug")
+		return log_level::debug;
+	if (name == "info")
+		return log_level::info;
+	if (name == "warn")
+		return log_level::warn;
+	if (name == "error")
+		return log_level::error;
+	if (name == "off")
+		return log_level::off;
+	return std::nullopt;
+};
+
+struct log_arg
+{
+	enum kind_type: utx::u8
+	{
+		none,
+		sint,
+		uint,
+		real,
+		literal,	// static storage, stored by pointer; only the names of bool values
+		text		// copied into the arena of the ring, later of the flush thread
+	};
+	struct text_ref
+	{
+		utx::u32 offset;
+		utx::u32 size;
+	};
+
+	kind_type kind = none;
+	union
+	{
+		std::int64_t i;
+		std::uint64_t u;
+		double f;
+		const char * lit;
+		text_ref str;
+	};
+
+	std::string_view view(const char * arena) const
+	{
+		switch (kind)
+		{
+		case literal:
+			return lit;
+		case text:
+			return {arena + str.offset, str.size};
+		default:
+			return {};
+		}
+	}
+};
+
+struct log_record
+{
+	constexpr static utx::u32 max_args = 8;
+
+	std::uint64_t time;	// ticks while in a ring, ns since start once drained
+	std::uint64_t arena_end;	// arena position after the text of this record
+	utx::u32 thread;
+	log_level level;
+	utx::u8 count;
+	log_arg args[max_args];
+};
+
+struct log_ring
+{
+	constexpr static std::uint64_t capacity = 1024;
+	constexpr static std::uint64_t arena_size = 1 << 16;
+	// Small enough that a record being encoded never needs the whole arena.
+	constexpr static std::uint64_t max_text = arena_size / 32;
+
+	std::array<log_record, capacity> records;
+	std::array<char, arena_size> arena;
+	alignas(64) std::atomic<std::uint64_t> head = 0;	// written by the producer
+	std::uint64_t arena_head = 0;	// producer only
+	alignas(64) std::atomic<std::uint64_t> tail = 0;	// written by the consumer
+	std::atomic<std::uint64_t> arena_tail = 0;	// written by the consumer
+	utx::u32 thread = 0;
+	std::atomic<bool> orphaned = false;	// the producer thread has exited
+};
+
+////////////////////////////////////////////////////////////////////////
+// class logger
+
+class logger
+{
+protected:
+// data
+#if defined(__x86_64__) || defined(__i386__)
+	// Assumes an invariant TSC, which every x86 CPU of the last decade has.
+	constexpr static bool __tsc = true;
+#else
+	constexpr static bool __tsc = false;
+#endif
+
+	std::atomic<log_level> __level = log_level::info;
+	const std::chrono::steady_clock::time_point __start = std::chrono::steady_clock::now();
+	const std::uint64_t __start_ticks = ticks();
+
+	std::mutex __rings_mutex;
+	std::vector<std::shared_ptr<log_ring>> __rings;
+	utx::u32 __next_thread = 0;
+
+	// Held while draining, so the rings keep a single consumer.
+	std::mutex __drain_mutex;
+	std::vector<log_record> __pending;
+	std::string __pending_text;	// text of __pending
+	std::string __out;	// formatted, not yet written
+	std::ofstream __file;
+
+	std::mutex __wake_mutex;
+	std::condition_variable __wake;
+	std::atomic<bool> __stop = false;
+	std::jthread __flusher;
+
+protected:
+	// Marks the ring of an exiting thread, so the flush thread can forget it
+	// once it is empty.
+	struct producer
+	{
+		std::shared_ptr<log_ring> ring;
+
+		producer(logger & owner):
+			ring{std::make_shared<log_ring>()}
+		{
+			std::lock_guard lock{owner.__rings_mutex};
+			ring->thread = owner.__next_thread++;
+			owner.__rings.push_back(ring);
+		}
+		~producer()
+		{
+			ring->orphaned.store(true, std::memory_order_release);
+		}
+	};
+
+protected:
+// constructor
+	logger()
+	{
+		if (const char * env = std::getenv("MDINV_LOG_LEVEL"))
+		{
+			if (auto level = parse_log_level(env))
+				__level = *level;
+		}
+		__flusher = std::jthread{[this] {this->flush_loop();}};
+	}
+
+public:
+// destructor
+	virtual ~logger()
+	{
+		__stop = true;
+		this->wake();
+		if (__flusher.joinable())
+			__flusher.join();
+		this->flush();
+	}
+
+protected:
+// Removed
+	logger(const logger &) = delete;
+	logger & operator=(const logger &) = delete;
+
+protected:
+	static logger __instance;
+
+public:
+	static logger & instance()
+	{
+		return __instance;
+	}
+
+protected:
+	static std::uint64_t ticks()
+	{
+		if constexpr (__tsc)
+			return __rdtsc();
+		else
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()
+			).count());
+	}
+	// Measured against steady_clock over the whole run so far.
+	utx::f64 ns_per_tick() const
+	{
+		if constexpr (! __tsc)
+			return 1;
+		const std::uint64_t elapsed_ticks = ticks() - __start_ticks;
+		const auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - __start
+		).count();
+		return elapsed_ticks > 0 ? static_cast<utx::f64>(elapsed_ns) / elapsed_ticks : 1;
+	}
+
+	// Room for `size` bytes of text in one piece; waits while the arena is full.
+	char * reserve_text(log_ring & ring, log_arg & arg, std::size_t size)
+	{
+		std::uint64_t pos = ring.arena_head;
+		const std::uint64_t offset = pos % log_ring::arena_size;
+		if (offset + size > log_ring::arena_size)
+			pos += log_ring::arena_size - offset;
+		while (pos + size - ring.arena_tail.load(std::memory_order_acquire) > log_ring::arena_size)
+		{
+			this->wake();
+			std::this_thread::yield();
+		}
+		ring.arena_head = pos + size;
+		arg.kind = log_arg::text;
+		arg.str = {static_cast<utx::u32>(pos % log_ring::arena_size), static_cast<utx::u32>(size)};
+		return ring.arena.data() + pos % log_ring::arena_size;
+	}
+	void copy_text(log_ring & ring, log_arg & arg, std::string_view value)
+	{
+		const std::size_t size = std::min<std::size_t>(value.size(), log_ring::max_text);
+		std::memcpy(this->reserve_text(ring, arg, size), value.data(), size);
+	}
+	// As UTF-8.
+	void copy_text(log_ring & ring, log_arg & arg, std::wstring_view value)
+	{
+		auto utf8_size = [] (std::uint32_t c) -> std::size_t
+		{
+			return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+		};
+		std::size_t size = 0;
+		std::size_t count = 0;
+		for (wchar_t wc: value)
+		{
+			const std::size_t n = utf8_size(static_cast<std::uint32_t>(wc));
+			if (size + n > log_ring::max_text)
+				break;
+			size += n;
+			count++;
+		}
+
+		char * out = this->reserve_text(ring, arg, size);
+		for (wchar_t wc: value.substr(0, count))
+		{
+			const auto c = static_cast<std::uint32_t>(wc);
+			if (c < 0x80)
+				*out++ = static_cast<char>(c);
+			else if (c < 0x800)
+			{
+				*out++ = static_cast<char>(0xc0 | (c >> 6));
+				*out++ = static_cast<char>(0x80 | (c & 0x3f));
+			}
+			else if (c < 0x10000)
+			{
+				*out++ = static_cast<char>(0xe0 | (c >> 12));
+				*out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+				*out++ = static_cast<char>(0x80 | (c & 0x3f));
+			}
+			else
+			{
+				*out++ = static_cast<char>(0xf0 | (c >> 18));
+				*out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+				*out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+				*out++ = static_cast<char>(0x80 | (c & 0x3f));
+			}
+		}
+	}
+
+	template <typename type>
+	void encode(log_ring & ring, log_arg & arg, const type & value)
+	{
+		using value_type = std::remove_cvref_t<type>;
+		if constexpr (std::is_same_v<value_type, bool>)
+		{
+			arg.kind = log_arg::literal;
+			arg.lit = value ? "true" : "false";
+		}
+		else if constexpr (std::is_same_v<value_type, char>)
+		{
+			this->copy_text(ring, arg, std::string_view{&value, 1});
+		}
+		else if constexpr (std::is_enum_v<value_type>)
+		{
+			arg.kind = log_arg::sint;
+			arg.i = static_cast<std::int64_t>(value);
+		}
+		else if constexpr (std::is_integral_v<value_type> && std::is_signed_v<value_type>)
+		{
+			arg.kind = log_arg::sint;
+			arg.i = value;
+		}
+		else if constexpr (std::is_integral_v<value_type>)
+		{
+			arg.kind = log_arg::uint;
+			arg.u = value;
+		}
+		else if constexpr (std::is_floating_point_v<value_type>)
+		{
+			arg.kind = log_arg::real;
+			arg.f = value;
+		}
+		else if constexpr (std::is_array_v<value_type> && std::is_same_v<std::remove_extent_t<value_type>, char>)
+		{
+			// Not necessarily a literal, and not necessarily terminated.
+			this->copy_text(ring, arg, std::string_view{value, ::strnlen(value, std::extent_v<value_type>)});
+		}
+		else if constexpr (std::is_convertible_v<const value_type &, std::string_view>)
+		{
+			this->copy_text(ring, arg, std::string_view{value});
+		}
+		else if constexpr (std::is_convertible_v<const value_type &, std::wstring_view>)
+		{
+			this->copy_text(ring, arg, std::wstring_view{value});
+		}
+		else if constexpr (std::is_same_v<value_type, std::filesystem::path>)
+		{
+			this->copy_text(ring, arg, std::basic_string_view<std::filesystem::path::value_type>{value.native()});
+		}
+		else
+		{
+			// Anything else streamable; rare enough to afford the allocation.
+			std::ostringstream out;
+			out << value;
+			this->copy_text(ring, arg, std::string_view{out.str()});
+		}
+	}
+
+	void wake()
+	{
+		__wake.notify_one();
+	}
+
+	void flush_loop()
+	{
+		while (! __stop)
+		{
+			{
+				std::unique_lock lock{__wake_mutex};
+				__wake.wait_for(lock, std::chrono::milliseconds{10});
+			}
+			this->flush();
+		}
+	}
+
+	template <typename type>
+	static void append_number(std::string & out, type value)
+	{
+		char buffer[32];
+		std::to_chars_result result;
+		if constexpr (std::is_floating_point_v<type>)
+			result = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::general, 6);	// like operator<<
+		else
+			result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+		out.append(buffer, result.ptr);
+	}
+	void write_text(const log_record & record)
+	{
+		for (utx::u32 i=0; i<record.count; i++)
+		{
+			if (i > 0)
+				__out += ' ';
+			const log_arg & arg = record.args[i];
+			switch (arg.kind)
+			{
+			case log_arg::sint:
+				append_number(__out, arg.i);
+				break;
+			case log_arg::uint:
+				append_number(__out, arg.u);
+				break;
+			case log_arg::real:
+				append_number(__out, arg.f);
+				break;
+			default:
+				__out += arg.view(__pending_text.data());
+				break;
+			}
+		}
+		__out += '\n';
+	}
+
+	// Binary log layout, little endian as written by the host:
+	//	header: "MDINVLOG", u32 version, u64 system clock ns at start
+	//	record: u64 ns since start, u32 thread, u8 level, u8 count, args
+	//	arg:    u8 kind (1 sint, 2 uint, 3 real, 5 string), then i64/u64/f64
+	//	        for numbers, or u32 size + bytes for strings
+	template <typename type>
+	void write_raw(const type & value)
+	{
+		__file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+	}
+	void write_binary(const log_record & record)
+	{
+		write_raw(record.time);
+		write_raw(record.thread);
+		write_raw(static_cast<utx::u8>(record.level));
+		write_raw(record.count);
+		for (utx::u32 i=0; i<record.count; i++)
+		{
+			const log_arg & arg = record.args[i];
+			switch (arg.kind)
+			{
+			case log_arg::sint:
+				write_raw(static_cast<utx::u8>(log_arg::sint));
+				write_raw(arg.i);
+				break;
+			case log_arg::uint:
+				write_raw(static_cast<utx::u8>(log_arg::uint));
+				write_raw(arg.u);
+				break;
+			case log_arg::real:
+				write_raw(static_cast<utx::u8>(log_arg::real));
+				write_raw(arg.f);
+				break;
+			default:
+			{
+				const std::string_view text = arg.view(__pending_text.data());
+				write_raw(static_cast<utx::u8>(log_arg::text));
+				write_raw(static_cast<utx::u32>(text.size()));
+				__file.write(text.data(), static_cast<std::streamsize>(text.size()));
+				break;
+			}
+			}
+		}
+	}
+
+public:
+	template <typename ... types>
+	void write(log_level level, const types & ... args)
+	{
+		static_assert(sizeof...(args) <= log_record::max_args, "too many log arguments");
+		if (! this->enabled(level))
+			return;
+
+		thread_local producer self{*this};
+		log_ring & ring = *self.ring;
+		const std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+		while (head - ring.tail.load(std::memory_order_acquire) >= log_ring::capacity)
+		{
+			this->wake();
+			std::this_thread::yield();
+		}
+
+		// The slot belongs to this thread until head moves past it.
+		log_record & record = ring.records[head % log_ring::capacity];
+		record.time = ticks();
+		record.level = level;
+		record.count = 0;
+		(this->encode(ring, record.args[record.count++], args), ...);
+		record.arena_end = ring.arena_head;
+		ring.head.store(head+1, std::memory_order_release);
+
+		// Do not wait for the next tick with warnings, errors, or a half full
+		// ring; the latter only now and then, waking costs a system call.
+		if (level >= log_level::warn || ((head+1) % (log_ring::capacity/8) == 0 &&
+			head+1 - ring.tail.load(std::memory_order_relaxed) >= log_ring::capacity/2))
+			this->wake();
+	}
+
+	// Format everything logged so far. Called by the flush thread, and by
+	// anyone who needs the output before going on (exit, fatal errors).
+	void flush()
+	{
+		std::lock_guard lock{__drain_mutex};
+
+		std::vector<std::shared_ptr<log_ring>> rings;
+		{
+			std::lock_guard rings_lock{__rings_mutex};
+			rings = __rings;
+		}
+
+		// Copy records and their text out, so the rings can be refilled while formatting.
+		__pending.clear();
+		__pending_text.clear();
+		for (const auto & ring: rings)
+		{
+			const bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+			const std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			const std::uint64_t head = ring->head.load(std::memory_order_acquire);
+			for (std::uint64_t i=tail; i<head; i++)
+			{
+				log_record & record = __pending.emplace_back(ring->records[i % log_ring::capacity]);
+				record.thread = ring->thread;
+				for (utx::u32 a=0; a<record.count; a++)
+				{
+					log_arg & arg = record.args[a];
+					if (arg.kind != log_arg::text)
+						continue;
+					const std::string_view text = arg.view(ring->arena.data());
+					arg.str.offset = static_cast<utx::u32>(__pending_text.size());
+					__pending_text += text;
+				}
+			}
+			if (head > tail)
+				ring->arena_tail.store(ring->records[(head-1) % log_ring::capacity].arena_end, std::memory_order_release);
+			ring->tail.store(head, std::memory_order_release);
+
+			if (orphaned)
+			{
+				std::lock_guard rings_lock{__rings_mutex};
+				std::erase(__rings, ring);
+			}
+		}
+		if (__pending.empty())
+			return;
+
+		const utx::f64 scale = this->ns_per_tick();
+		for (log_record & record: __pending)
+		{
+			const auto since = static_cast<std::int64_t>(record.time - __start_ticks);
+			record.time = static_cast<std::uint64_t>(std::max<std::int64_t>(since, 0) * scale);
+		}
+		std::ranges::stable_sort(__pending, {}, &log_record::time);
+
+		// One write per run of records going to the same stream.
+		std::ostream * stream = &std::cout;
+		for (const log_record & record: __pending)
+		{
+			std::ostream * target = record.level >= log_level::warn ? &std::cerr : &std::cout;
+			if (target != stream)
+			{
+				stream->write(__out.data(), static_cast<std::streamsize>(__out.size()));
+				__out.clear();
+				stream = target;
+			}
+			this->write_text(record);
+			if (__file.is_open())
+				this->write_binary(record);
+		}
+		stream->write(__out.data(), static_cast<std::streamsize>(__out.size()));
+		__out.clear();
+		std::cout.flush();
+		if (__file.is_open())
+			__file.flush();
+	}
+
+	void open_file(const std::filesystem::path & path)
+	{
+		std::lock_guard lock{__drain_mutex};
+		__file.close();
+		__file.open(path, std::ios::binary | std::ios::trunc);
+		if (! __file)
+			throw std::runtime_error{"can not open log file " + path.string()};
+		const auto wall_ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()
+		).count());
+		__file.write("MDINVLOG", 8);
+		write_raw(static_cast<utx::u32>(2));
+		write_raw(wall_ns);
+	}
+
+public:
+// set
+	void set_level(log_level level)
+	{
+		__level.store(level, std::memory_order_relaxed);
+	}
+// get
+	log_level level() const
+	{
+		return __level.load(std::memory_order_relaxed);
+	}
+	bool enabled(log_level level) const
+	{
+		return level != log_level::off && level >= __level.load(std::memory_order_relaxed);
+	}
+}; // class logger
+logger logger::__instance{};
+
+// app_logger
+static logger & app_logger = logger::instance();
+
+auto log_debug = [] (const auto & ... args) {app_logger.write(log_level::debug, args...);};
+auto log_info = [] (const auto & ... args) {app_logger.write(log_level::info, args...);};
+auto log_warn = [] (const auto & ... args) {app_logger.write(log_level::warn, args...);};
+auto log_error = [] (const auto & ... args) {app_logger.write(log_level::error, args...);};
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_log_hpp__
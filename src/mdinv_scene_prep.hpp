@@ -0,0 +1,310 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_scene_prep_hpp__
+#define __mdinv_src_mdinv_scene_prep_hpp__
+
+#include <mdinv_config.hpp>
+#include <mdinv_compact_mesh.hpp>
+#include <mdinv_log.hpp>
+#include <mdinv_thread_pool.hpp>
+
+#include <nirtcpp.hpp>
+#include <utxcpp/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// class scene_prep
+//
+// Replaces one ISceneManager::drawAll() per viewport cell. The CPU side of
+// a frame (animation, frustum culling, material and transparency sorting)
+// is done for all cells at once on a thread pool, and each cell gets a list
+// of buffers, materials and transforms. The render loop then only replays
+// the lists to the driver, which stays on the main thread.
+//
+// The scene of the viewer holds only mesh nodes and cameras, so this covers
+// everything drawAll() would draw there.
+
+class scene_prep
+{
+public:
+	struct draw_item
+	{
+		const nirt::scene::IMeshBuffer * buffer;
+		const compact_buffer * compact;	// not null: draw this instead of `buffer`
+		const nirt::video::SMaterial * material;
+		nirt::core::matrix4 world;
+		utx::f32 distance;	// squared, from the camera; transparent items only
+		nirt::scene::IAnimatedMeshSceneNode * pose;	// not null: pose the shared mesh for this node first
+	};
+	struct draw_list
+	{
+		nirt::core::matrix4 projection;
+		nirt::core::matrix4 view;
+		std::vector<draw_item> solid;
+		std::vector<draw_item> transparent;
+	};
+
+protected:
+// data
+	constexpr static utx::u32 __report_every = 300;	// frames
+
+	nirt::video::IVideoDriver * __driver;
+	compact_store & __compact;
+	std::unique_ptr<thread_pool> __pool;	// null: everything on the calling thread
+
+	std::vector<draw_list> __lists;	// one per cell
+	std::vector<nirt::scene::IMesh *> __frame_meshes;	// one per node, for the current frame
+	std::vector<utx::u8> __posed_at_replay;	// one per node; not vector<bool>, set from several tasks
+
+	utx::u32 __frames = 0;
+	utx::f64 __prep_ms = 0;
+	utx::f64 __replay_ms = 0;
+
+public:
+// constructor
+	// threads: 0 for one per core, 1 to prepare on the calling thread.
+	scene_prep(nirt::NirtcppDevice * device, utx::u32 threads, compact_store & compact):
+		__driver{device->getVideoDriver()},
+		__compact{compact}
+	{
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		if (threads > 1)
+			__pool = std::make_unique<thread_pool>(threads);
+	}
+
+protected:
+// Removed
+	scene_prep(const scene_prep &) = delete;
+	scene_prep & operator=(const scene_prep &) = delete;
+
+protected:
+	template <typename F>
+	void for_each(utx::u32 count, F && func)
+	{
+		if (__pool)
+			__pool->parallel_for(count, std::forward<F>(func));
+		else
+		{
+			for (utx::u32 i=0; i<count; i++)
+				func(i);
+		}
+	}
+
+	// The mesh of `node` for its current frame, as getMeshForCurrentFrame()
+	// picks it for a node without joint control: within the node's loop range,
+	// blended between two frames.
+	static nirt::scene::IMesh * pose(nirt::scene::IAnimatedMeshSceneNode * node)
+	{
+		nirt::scene::IAnimatedMesh * mesh = node->getMesh();
+		if (! mesh)
+			return nullptr;
+		const utx::f32 frame = node->getFrameNr();
+		if (mesh->getMeshType() == nirt::scene::EAMT_SKINNED)
+		{
+			auto * skinned = static_cast<nirt::scene::ISkinnedMesh *>(mesh);
+			skinned->animateMesh(frame, 1.0f);
+			skinned->skinMesh();
+			return skinned;
+		}
+		return mesh->getMesh(
+			static_cast<utx::i32>(frame),
+			static_cast<utx::i32>(nirt::core::fract(frame) * 1000.f),
+			node->getStartFrame(),
+			node->getEndFrame()
+		);
+	}
+
+	// Once per frame, not once per cell as drawAll() did. Nodes sharing a
+	// mesh go to the same task. An animated mesh holds one pose in its own
+	// buffers, so when several nodes share one, each of them is posed again
+	// right before its buffers are replayed, as drawAll() does.
+	void animate(const std::vector<nirt::scene::IAnimatedMeshSceneNode *> & nodes, utx::u32 now)
+	{
+		std::unordered_map<nirt::scene::IAnimatedMesh *, std::vector<utx::u32>> by_mesh;
+		for (utx::u32 i=0; i<nodes.size(); i++)
+			by_mesh[nodes[i]->getMesh()].push_back(i);
+		std::vector<std::vector<utx::u32>> groups;
+		groups.reserve(by_mesh.size());
+		for (auto & [mesh, group]: by_mesh)
+			groups.push_back(std::move(group));
+
+		__frame_meshes.assign(nodes.size(), nullptr);
+		__posed_at_replay.assign(nodes.size(), 0);
+		this->for_each(static_cast<utx::u32>(groups.size()), [&] (utx::u32 g)
+		{
+			for (utx::u32 i: groups[g])
+			{
+				nirt::scene::IAnimatedMeshSceneNode * node = nodes[i];
+				node->OnAnimate(now);
+				__frame_meshes[i] = pose(node);
+			}
+			nirt::scene::IAnimatedMesh * mesh = nodes[groups[g].front()]->getMesh();
+			if (groups[g].size() > 1 && mesh &&
+				(mesh->getFrameCount() > 1 || mesh->getMeshType() == nirt::scene::EAMT_SKINNED))
+			{
+				for (utx::u32 i: groups[g])
+					__posed_at_replay[i] = 1;
+			}
+		});
+	}
+
+	void prepare_cell(draw_list & list, nirt::scene::ICameraSceneNode * camera,
+		const std::vector<nirt::scene::IAnimatedMeshSceneNode *> & nodes)
+	{
+		list.solid.clear();
+		list.transparent.clear();
+		list.projection = camera->getProjectionMatrix();
+		list.view = camera->getViewMatrix();
+
+		// Box culling, like the default EAC_BOX of drawAll().
+		const nirt::scene::SViewFrustum frustum{list.projection * list.view};
+		const nirt::core::aabbox3df frustum_box = frustum.getBoundingBox();
+		const nirt::core::vector3df eye = camera->getAbsolutePosition();
+
+		for (utx::u32 n=0; n<nodes.size(); n++)
+		{
+			nirt::scene::IAnimatedMeshSceneNode * node = nodes[n];
+			nirt::scene::IMesh * mesh = __frame_meshes[n];
+			if (! mesh || ! node->isVisible())
+				continue;
+			if (! node->getTransformedBoundingBox().intersectsWithBox(frustum_box))
+				continue;
+
+			const nirt::core::matrix4 & world = node->getAbsoluteTransformation();
+			nirt::scene::IAnimatedMeshSceneNode * posed = __posed_at_replay[n] ? node : nullptr;
+			for (utx::u32 i=0; i<mesh->getMeshBufferCount(); i++)
+			{
+				nirt::scene::IMeshBuffer * mb = mesh->getMeshBuffer(i);
+				const compact_buffer * compact = __compact.find(mb);
+				const nirt::video::SMaterial & material =
+					(node->isReadOnlyMaterials() || i >= node->getMaterialCount()) ?
+					mb->getMaterial() : node->getMaterial(i);
+
+				nirt::video::IMaterialRenderer * renderer = __driver->getMaterialRenderer(material.MaterialType);
+				if (renderer && renderer->isTransparent())
+				{
+					nirt::core::aabbox3df box = mb->getBoundingBox();
+					world.transformBoxEx(box);
+					list.transparent.push_back({mb, compact, &material, world, eye.getDistanceFromSQ(box.getCenter()), posed});
+				}
+				else
+				{
+					list.solid.push_back({mb, compact, &material, world, 0, posed});
+				}
+			}
+		}
+
+		// Solid: group by texture and material type to save state changes.
+		// Items posed at replay come last, each node's buffers together.
+		std::ranges::stable_sort(list.solid, [] (const draw_item & a, const draw_item & b)
+		{
+			if ((a.pose != nullptr) != (b.pose != nullptr))
+				return b.pose != nullptr;
+			if (a.pose)
+				return false;	// stable: node order
+			if (a.material->getTexture(0) != b.material->getTexture(0))
+				return a.material->getTexture(0) < b.material->getTexture(0);
+			return a.material->MaterialType < b.material->MaterialType;
+		});
+		// Transparent: back to front.
+		std::ranges::sort(list.transparent, [] (const draw_item & a, const draw_item & b)
+		{
+			return a.distance > b.distance;
+		});
+	}
+
+public:
+	// Build the draw lists of all cells; cameras[i] is the camera of cell i.
+	void prepare(const std::vector<nirt::scene::IAnimatedMeshSceneNode *> & nodes,
+		const std::vector<nirt::scene::ICameraSceneNode *> & cameras, utx::u32 now)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		// Cheap, and sets the driver transforms: keep it here on the main thread.
+		for (nirt::scene::ICameraSceneNode * camera: cameras)
+		{
+			camera->OnAnimate(now);
+			camera->render();
+		}
+
+		this->animate(nodes, now);
+
+		__lists.resize(cameras.size());
+		this->for_each(static_cast<utx::u32>(cameras.size()), [&] (utx::u32 cell)
+		{
+			this->prepare_cell(__lists[cell], cameras[cell], nodes);
+		});
+
+		__prep_ms += std::chrono::duration<utx::f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Draw the list of one cell into the current view port.
+	void replay(utx::u32 cell)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		const draw_list & list = __lists[cell];
+		__driver->setTransform(nirt::video::ETS_PROJECTION, list.projection);
+		__driver->setTransform(nirt::video::ETS_VIEW, list.view);
+		nirt::scene::IAnimatedMeshSceneNode * posed = nullptr;
+		for (const std::vector<draw_item> * items: {&list.solid, &list.transparent})
+		{
+			for (const draw_item & item: *items)
+			{
+				if (item.pose && item.pose != posed)
+				{
+					pose(item.pose);
+					posed = item.pose;
+				}
+				__driver->setTransform(nirt::video::ETS_WORLD, item.world);
+				__driver->setMaterial(*item.material);
+				if (item.compact)
+					__compact.draw(*item.compact);
+				else
+					__driver->drawMeshBuffer(item.buffer);
+			}
+		}
+
+		__replay_ms += std::chrono::duration<utx::f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Called once per frame; logs the average CPU time of both parts.
+	void frame_done()
+	{
+		if (++__frames < __report_every)
+			return;
+		log_info(
+			"scene prep:", __pool ? __pool->size() : 1u, "threads,", __lists.size(),
+			"cells | prepare ms", __prep_ms/__frames, "| replay ms", __replay_ms/__frames
+		);
+		const compact_store::draw_stats compact = __compact.take_stats();
+		if (compact.decoded_bytes > 0)
+		{
+			log_info(
+				"scene prep: compact vertices per frame | decode ms", compact.decode_ms/__frames,
+				"| bytes decoded", compact.decoded_bytes/__frames, "| bytes sent", compact.sent_bytes/__frames
+			);
+		}
+		__frames = 0;
+		__prep_ms = 0;
+		__replay_ms = 0;
+	}
+}; // class scene_prep
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_scene_prep_hpp__
@@ -0,0 +1,512 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_server_hpp__
+#define __mdinv_src_mdinv_server_hpp__
+
+#include <mdinv_config.hpp>
+#include <mdinv_content_cache.hpp>
+#include <mdinv_content_hash.hpp>
+#include <mdinv_log.hpp>
+#include <mdinv_thread_pool.hpp>
+
+#include <nirtcpp.hpp>
+#include <utxcpp/core.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// struct mesh_stats
+
+struct mesh_stats
+{
+	utx::u32 frames = 0;
+	utx::u32 buffers = 0;
+	utx::u32 vertices = 0;
+	utx::u32 indices = 0;
+	nirt::core::aabbox3df box;
+
+	std::string str() const
+	{
+		std::ostringstream out;
+		out << "frames=" << frames
+			<< " buffers=" << buffers
+			<< " vertices=" << vertices
+			<< " triangles=" << indices/3
+			<< " box=" << box.MinEdge.X << ',' << box.MinEdge.Y << ',' << box.MinEdge.Z
+			<< ':' << box.MaxEdge.X << ',' << box.MaxEdge.Y << ',' << box.MaxEdge.Z;
+		return out.str();
+	}
+};
+
+////////////////////////////////////////////////////////////////////////
+// class render_server
+//
+// `mdinv --serve [socket]` keeps one device and its warm mesh and texture
+// caches alive, and answers line based requests on a Unix domain socket.
+// Fields of a request are separated by tabs, so paths may contain spaces:
+//
+//	load	<mesh>
+//	stats	<mesh>
+//	render	<mesh>	<views>	<png prefix>
+//	shutdown
+//
+// Every request gets one line back, "ok ..." or "error ...", ending with the
+// latency the server measured for it. run() polls all connections and hands
+// each complete request line to a worker pool, so an idle client holds no
+// worker. Requests of one connection are answered in order, one at a time.
+// nirtcpp itself is not thread safe, so work touching the device is
+// serialized and everything else (reading and hashing files, answering stats
+// of known content, replies) runs in parallel.
+
+class render_server
+{
+protected:
+	struct connection
+	{
+		std::string buffer;	// received, not yet a complete line
+		std::deque<std::string> lines;	// complete, waiting for their turn
+		bool busy = false;	// a worker is answering one of them
+		bool closed = false;	// by the client; the fd is closed when not busy
+	};
+
+protected:
+// data
+	constexpr static utx::u32 __render_size = 512;
+
+	std::string __socket_path;
+	nirt::NirtcppDevice * __device = nullptr;
+	nirt::scene::ISceneManager * __smgr = nullptr;
+	nirt::video::IVideoDriver * __driver = nullptr;
+	std::unique_ptr<content_cache> __cache;
+
+	std::mutex __device_mutex;
+
+	std::mutex __stats_mutex;
+	std::unordered_map<content_digest, mesh_stats, content_digest_hasher> __stats;
+
+	std::atomic<bool> __running = true;
+	int __listen_fd = -1;
+	ino_t __socket_inode = 0;	// of the socket file bound by run(), 0 if none
+
+	int __wake[2] = {-1, -1};	// stop() writes here to wake the poll() in run()
+
+	std::mutex __clients_mutex;
+	std::unordered_map<int, connection> __clients;
+
+	std::unique_ptr<thread_pool> __pool;
+
+public:
+// constructor
+	explicit render_server(std::string_view socket_path):
+		__socket_path{socket_path}
+	{
+		// The software renderer needs no GPU, but still opens a small X11
+		// window: on a machine without a display run it under Xvfb.
+		__device = nirt::createDevice(
+			nirt::video::EDT_BURNINGSVIDEO,
+			nirt::core::dimension2du{__render_size, __render_size},
+			32,
+			false,
+			false,
+			false,
+			nullptr
+		);
+		if (! __device)
+			throw std::runtime_error{"can not create Nirtcpp Device!"};
+		__smgr = __device->getSceneManager();
+		__driver = __device->getVideoDriver();
+		__cache = std::make_unique<content_cache>(__device);
+		if (::pipe2(__wake, O_CLOEXEC | O_NONBLOCK) < 0)
+			throw std::runtime_error{"can not create pipe"};
+		__pool = std::make_unique<thread_pool>();
+	}
+// destructor
+	virtual ~render_server()
+	{
+		this->stop();
+		// Workers must be gone before the device they use.
+		__pool.reset();
+		for (const auto & [fd, client]: __clients)
+			::close(fd);
+		if (__listen_fd >= 0)
+			::close(__listen_fd);
+		for (int fd: __wake)
+		{
+			if (fd >= 0)
+				::close(fd);
+		}
+		// Only our own socket: another server may have taken the path since.
+		struct stat info;
+		if (__socket_inode != 0 && ::stat(__socket_path.data(), &info) == 0 && info.st_ino == __socket_inode)
+			::unlink(__socket_path.data());
+		__cache.reset();
+		__device->drop();
+	}
+
+protected:
+// Removed
+	render_server(const render_server &) = delete;
+	render_server & operator=(const render_server &) = delete;
+
+protected:
+	static std::vector<std::string> split(const std::string & line)
+	{
+		std::vector<std::string> fields;
+		std::string::size_type start = 0;
+		while (true)
+		{
+			auto pos = line.find('\t', start);
+			fields.push_back(line.substr(start, pos-start));
+			if (pos == std::string::npos)
+				break;
+			start = pos+1;
+		}
+		return fields;
+	}
+	static bool write_line(int fd, std::string line)
+	{
+		line += '\n';
+		const char * data = line.data();
+		std::size_t left = line.size();
+		while (left > 0)
+		{
+			ssize_t n = ::send(fd, data, left, MSG_NOSIGNAL);
+			if (n <= 0)
+				return false;
+			data += n;
+			left -= static_cast<std::size_t>(n);
+		}
+		return true;
+	}
+
+	// Read and hash outside __device_mutex; only decoding needs the device.
+	struct mesh_file
+	{
+		fs::path path;
+		std::vector<char> bytes;
+		content_digest digest;
+	};
+	static mesh_file read_mesh_file(const std::string & path)
+	{
+		mesh_file file{fs::weakly_canonical(fs::path{utx::s2w(path)}), {}, {}};
+		file.digest = content_hash::file(file.path, &file.bytes);
+		return file;
+	}
+
+	// Caller holds __device_mutex.
+	nirt::scene::IAnimatedMesh * load_locked(mesh_file & file)
+	{
+		nirt::scene::IAnimatedMesh * mesh = __cache->load_mesh(file.path, file.bytes, file.digest);
+		if (! mesh)
+			throw std::runtime_error{"can not load " + file.path.string()};
+		std::lock_guard lock{__stats_mutex};
+		if (! __stats.contains(file.digest))
+		{
+			mesh_stats stats;
+			stats.frames = mesh->getFrameCount();
+			nirt::scene::IMesh * frame = mesh->getMesh(0);
+			stats.buffers = frame->getMeshBufferCount();
+			for (utx::u32 i=0; i<stats.buffers; i++)
+			{
+				stats.vertices += frame->getMeshBuffer(i)->getVertexCount();
+				stats.indices += frame->getMeshBuffer(i)->getIndexCount();
+			}
+			stats.box = mesh->getBoundingBox();
+			__stats[file.digest] = stats;
+		}
+		return mesh;
+	}
+
+	std::string request_load(const std::vector<std::string> & fields)
+	{
+		if (fields.size() != 2)
+			throw std::runtime_error{"usage: load <mesh>"};
+		mesh_file file = read_mesh_file(fields[1]);
+		std::lock_guard lock{__device_mutex};
+		this->load_locked(file);
+		return "loaded " + fields[1];
+	}
+
+	std::string request_stats(const std::vector<std::string> & fields)
+	{
+		if (fields.size() != 2)
+			throw std::runtime_error{"usage: stats <mesh>"};
+		mesh_file file = read_mesh_file(fields[1]);
+		{
+			// Content seen before: no need to wait for the device.
+			std::lock_guard lock{__stats_mutex};
+			if (auto itr = __stats.find(file.digest); itr != __stats.end())
+				return itr->second.str();
+		}
+		{
+			std::lock_guard lock{__device_mutex};
+			this->load_locked(file);
+		}
+		std::lock_guard lock{__stats_mutex};
+		return __stats.at(file.digest).str();
+	}
+
+	std::string request_render(const std::vector<std::string> & fields)
+	{
+		if (fields.size() != 4)
+			throw std::runtime_error{"usage: render <mesh> <views> <png prefix>"};
+		const utx::i32 views = std::stoi(fields[2]);
+		if (views <= 0 || views > 360)
+			throw std::runtime_error{"views must be in [1, 360]"};
+		const std::string & prefix = fields[3];
+
+		mesh_file file = read_mesh_file(fields[1]);
+		std::lock_guard lock{__device_mutex};
+		nirt::scene::IAnimatedMesh * mesh = this->load_locked(file);
+
+		nirt::scene::IAnimatedMeshSceneNode * node = __smgr->addAnimatedMeshSceneNode(mesh);
+		if (! node)
+			throw std::runtime_error{"can not add mesh node"};
+		node->setMaterialFlag(nirt::video::EMF_LIGHTING, false);
+
+		const nirt::core::aabbox3df & aabb = node->getBoundingBox();
+		const nirt::core::vector3df center = aabb.getCenter();
+		const utx::f32 distance = (aabb.MaxEdge - aabb.MinEdge).getLength() / 2 * 3.2f;
+		nirt::scene::ICameraSceneNode * camera = __smgr->addCameraSceneNode(nullptr, {0, 0, -distance}, center);
+
+		std::string written;
+		for (utx::i32 k=0; k<views; k++)
+		{
+			const utx::f32 angle = 2 * std::numbers::pi_v<utx::f32> * k / views;
+			camera->setPosition(center + nirt::core::vector3df{
+				distance * std::sin(angle), 0, -distance * std::cos(angle)
+			});
+			camera->setTarget(center);
+
+			__driver->beginScene(true, true, nirt::video::SColor{0xff335774});
+			__smgr->drawAll();
+			__driver->endScene();
+
+			nirt::video::IImage * image = __driver->createScreenShot();
+			if (! image)
+				continue;
+			const std::string file = prefix + '-' + std::to_string(k) + ".png";
+			if (__driver->writeImageToFile(image, file.data()))
+				written += ' ' + file;
+			image->drop();
+		}
+		node->remove();
+		camera->remove();
+		return "rendered" + written;
+	}
+
+	// Poll thread: the connection is readable.
+	void read_connection(int fd)
+	{
+		char chunk[4096];
+		const ssize_t n = ::recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+
+		std::lock_guard lock{__clients_mutex};
+		auto itr = __clients.find(fd);
+		if (itr == __clients.end())
+			return;
+		connection & client = itr->second;
+		if (n <= 0)
+		{
+			client.closed = true;
+			if (! client.busy)
+			{
+				::close(fd);
+				__clients.erase(itr);
+			}
+			return;
+		}
+		client.buffer.append(chunk, static_cast<std::size_t>(n));
+		std::string::size_type pos;
+		while ((pos = client.buffer.find('\n')) != std::string::npos)
+		{
+			client.lines.push_back(client.buffer.substr(0, pos));
+			client.buffer.erase(0, pos+1);
+		}
+		if (! client.busy && ! client.lines.empty())
+		{
+			client.busy = true;
+			__pool->submit([this, fd] {this->answer_next(fd);});
+		}
+	}
+
+	// Worker: answer the oldest waiting request of a connection, then queue
+	// the next one behind the requests of other connections.
+	void answer_next(int fd)
+	{
+		std::string line;
+		{
+			std::lock_guard lock{__clients_mutex};
+			connection & client = __clients.at(fd);
+			line = std::move(client.lines.front());
+			client.lines.pop_front();
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		std::string reply;
+		try
+		{
+			reply = "ok " + this->handle(this->split(line));
+		}
+		catch (const std::exception & err)
+		{
+			reply = std::string{"error "} + err.what();
+		}
+		const utx::f64 latency_ms = std::chrono::duration<utx::f64, std::milli>(
+			std::chrono::steady_clock::now() - start
+		).count();
+		log_info("request:", line, "| latency:", latency_ms, "ms");
+		const bool sent = write_line(fd, reply + " latency_ms=" + std::to_string(latency_ms));
+
+		std::lock_guard lock{__clients_mutex};
+		auto itr = __clients.find(fd);
+		connection & client = itr->second;
+		if (sent && __running && ! client.lines.empty())
+		{
+			__pool->submit([this, fd] {this->answer_next(fd);});
+			return;
+		}
+		client.busy = false;
+		if (! sent || client.closed)
+		{
+			::close(fd);
+			__clients.erase(itr);
+		}
+	}
+
+	std::string handle(const std::vector<std::string> & fields)
+	{
+		const std::string & command = fields[0];
+		if (command == "load")
+			return this->request_load(fields);
+		if (command == "stats")
+			return this->request_stats(fields);
+		if (command == "render")
+			return this->request_render(fields);
+		if (command == "shutdown")
+		{
+			this->stop();
+			return "shutting down";
+		}
+		throw std::runtime_error{"unknown request: " + command};
+	}
+
+public:
+	// Make run() return; requests already handed to workers are finished.
+	void stop()
+	{
+		__running = false;
+		const char wake = 1;
+		[[maybe_unused]] const ssize_t n = ::write(__wake[1], &wake, 1);
+	}
+
+	void run()
+	{
+		__listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (__listen_fd < 0)
+			throw std::runtime_error{"can not create socket"};
+
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (__socket_path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error{"socket path is too long: " + __socket_path};
+		std::copy(__socket_path.begin(), __socket_path.end(), addr.sun_path);
+
+		// A socket file left by a server that died can be replaced, one that
+		// still accepts connections belongs to a running server. Anything
+		// else at the path is not ours to remove.
+		struct stat existing;
+		if (::lstat(__socket_path.data(), &existing) == 0)
+		{
+			if (! S_ISSOCK(existing.st_mode))
+				throw std::runtime_error{"not a socket, refusing to replace: " + __socket_path};
+			const int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			const bool live = probe >= 0 &&
+				::connect(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+			if (probe >= 0)
+				::close(probe);
+			if (live)
+				throw std::runtime_error{"a server is already running on " + __socket_path};
+			::unlink(__socket_path.data());
+		}
+		if (::bind(__listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+			throw std::runtime_error{"can not bind " + __socket_path};
+		struct stat info;
+		if (::stat(__socket_path.data(), &info) == 0)
+			__socket_inode = info.st_ino;
+		if (::listen(__listen_fd, 64) < 0)
+			throw std::runtime_error{"can not listen on " + __socket_path};
+
+		log_info("serving on", __socket_path, "with", __pool->size(), "workers");
+
+		std::vector<pollfd> fds;
+		while (__running)
+		{
+			fds.assign({{__wake[0], POLLIN, 0}, {__listen_fd, POLLIN, 0}});
+			{
+				std::lock_guard lock{__clients_mutex};
+				for (const auto & [fd, client]: __clients)
+				{
+					if (! client.closed)
+						fds.push_back({fd, POLLIN, 0});
+				}
+			}
+			if (::poll(fds.data(), fds.size(), -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			if (fds[0].revents != 0)
+				break;	// stop()
+
+			for (std::size_t i=2; i<fds.size(); i++)
+			{
+				if (fds[i].revents != 0)
+					this->read_connection(fds[i].fd);
+			}
+			if (fds[1].revents & POLLIN)
+			{
+				const int fd = ::accept4(__listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+				if (fd >= 0)
+				{
+					std::lock_guard lock{__clients_mutex};
+					__clients.emplace(fd, connection{});
+				}
+			}
+		}
+		log_info("server stopped");
+	}
+}; // class render_server
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_server_hpp__
@@ -0,0 +1,118 @@
+//
+// Copyright (c) 2023 Fas Xmut (fasxmut AT protonmail.com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef __mdinv_src_mdinv_thread_pool_hpp__
+#define __mdinv_src_mdinv_thread_pool_hpp__
+
+#include <utxcpp/core.hpp>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mdinv
+{
+
+////////////////////////////////////////////////////////////////////////
+// class thread_pool
+
+class thread_pool
+{
+protected:
+// data
+	std::vector<std::jthread> __workers;
+	std::deque<std::function<void()>> __tasks;
+	std::mutex __mutex;
+	std::condition_variable __cv;
+	bool __stop = false;
+
+public:
+// constructor
+	explicit thread_pool(utx::u32 count = std::max(1u, std::thread::hardware_concurrency()))
+	{
+		for (utx::u32 i=0; i<count; i++)
+			__workers.emplace_back([this] {this->worker();});
+	}
+// destructor
+	virtual ~thread_pool()
+	{
+		{
+			std::lock_guard lock{__mutex};
+			__stop = true;
+		}
+		__cv.notify_all();
+		// Join before the mutex and condition variable go away; queued tasks are finished first.
+		__workers.clear();
+	}
+
+protected:
+// Removed
+	thread_pool(const thread_pool &) = delete;
+	thread_pool & operator=(const thread_pool &) = delete;
+
+protected:
+	void worker()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock lock{__mutex};
+				__cv.wait(lock, [this] {return __stop || ! __tasks.empty();});
+				if (__tasks.empty())
+					return;
+				task = std::move(__tasks.front());
+				__tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+public:
+	template <typename F>
+	std::future<void> submit(F && func)
+	{
+		auto task = std::make_shared<std::packaged_task<void()>>(std::forward<F>(func));
+		std::future<void> result = task->get_future();
+		{
+			std::lock_guard lock{__mutex};
+			__tasks.emplace_back([task] {(*task)();});
+		}
+		__cv.notify_one();
+		return result;
+	}
+
+	// Run func(0) .. func(count-1) on the pool and wait for all of them.
+	// The first exception thrown by a task is rethrown here.
+	template <typename F>
+	void parallel_for(utx::u32 count, F && func)
+	{
+		std::vector<std::future<void>> done;
+		done.reserve(count);
+		for (utx::u32 i=0; i<count; i++)
+			done.push_back(this->submit([&func, i] {func(i);}));
+		for (std::future<void> & result: done)
+			result.wait();
+		for (std::future<void> & result: done)
+			result.get();
+	}
+
+public:
+// get
+	utx::u32 size() const
+	{
+		return static_cast<utx::u32>(__workers.size());
+	}
+}; // class thread_pool
+
+} // namespace mdinv
+
+#endif // __mdinv_src_mdinv_thread_pool_hpp__
@@ -9,6 +9,9 @@
 #define __mdinv_src_mdinv_window_event_hpp__
 
 #include <mdinv_config.hpp>
+#include <mdinv_content_cache.hpp>
+#include <mdinv_hot_reload.hpp>
+#include <mdinv_log.hpp>
 #include <nirtcpp.hpp>
 #include <utxcpp/core.hpp>
 
@@ -29,10 +32,17 @@ protected:
 	std::vector<nirt::scene::ICameraSceneNode *> cameras;
 
 	std::vector<nirt::scene::IAnimatedMeshSceneNode *> added_mesh_list;
+	std::vector<fs::path> added_mesh_files; // canonical, same order as added_mesh_list
+
+	mdinv::content_cache mesh_cache;
+	mdinv::hot_reload file_watch;
+	// reloaded file, time it was saved; reported once the new picture is shown.
+	std::vector<std::pair<fs::path, std::chrono::steady_clock::time_point>> reloaded;
 public:
-	window_event(nirt::NirtcppDevice * device, utx::f32 box_slide):
+	window_event(nirt::NirtcppDevice * device, utx::f32 box_slide, mdinv::compact_store & compact):
 		device{device},
-		box_slide{box_slide}
+		box_slide{box_slide},
+		mesh_cache{device, &compact}
 	{
 		ngui = device->getGUIEnvironment();
 		smgr = device->getSceneManager();
@@ -89,6 +99,14 @@ public:
 	{
 		return cameras[index];
 	}
+	const std::vector<nirt::scene::ICameraSceneNode *> & camera_list() const
+	{
+		return cameras;
+	}
+	const std::vector<nirt::scene::IAnimatedMeshSceneNode *> & mesh_list() const
+	{
+		return added_mesh_list;
+	}
 	bool OnEvent(const nirt::SEvent & event) override
 	{
 		this->gui_event(event);
@@ -167,8 +185,7 @@ public:
 	
 	void try_load_mesh(const std::wstring_view filename)
 	{
-		utx::printnl("try loading mesh ....");
-		std::wcout << filename << '\n';
+		log_info("try loading mesh ....", filename);
 		try
 		{
 			if (this->added_mesh_list.size() >= this->cameras.size())
@@ -176,9 +193,10 @@ public:
 			if (this->vp_centers.size() != this->cameras.size())
 				throw std::runtime_error{"vp_centers and cameras size violation!"};
 			utx::u32 vp_index = added_mesh_list.size();
+			const fs::path path = fs::weakly_canonical(fs::path{filename});
 
 			auto * node = smgr->addAnimatedMeshSceneNode(
-				smgr->getMesh(filename.data()),	
+				mesh_cache.load_mesh(filename),
 				nullptr,
 				-1,
 				nirt::core::vector3df{0},
@@ -202,6 +220,10 @@ public:
 			cameras[vp_index]->setPosition(dirvec);
 
 			this->added_mesh_list.push_back(node);
+			this->added_mesh_files.push_back(path);
+
+			for (const auto & [file, digest]: mesh_cache.sources(path))
+				file_watch.watch(file, digest);
 		}
 		catch (const std::exception & err)
 		{
@@ -221,7 +243,7 @@ public:
 	{
 		if (this->added_mesh_list.empty())
 		{
-			utx::printe("No mesh to close!");
+			log_warn("No mesh to close!");
 			return;
 		}
 		auto itr = this->added_mesh_list.end();
@@ -229,12 +251,107 @@ public:
 		//(*itr)->drop();
 		(*itr)->getParent()->removeChild(*itr);
 		this->added_mesh_list.erase(itr);
+		const fs::path closed = this->added_mesh_files.back();
+		this->added_mesh_files.pop_back();
+		this->unwatch_unused(closed);
 	}
 	void close_all_mesh()
 	{
 		while (! this->added_mesh_list.empty())
 			this->close_last_mesh();
 	}
+
+protected:
+	// Stop watching the files of a closed mesh that no open mesh uses.
+	void unwatch_unused(const fs::path & closed)
+	{
+		std::vector<fs::path> in_use;
+		for (const fs::path & open: added_mesh_files)
+		{
+			for (const auto & [file, digest]: mesh_cache.sources(open))
+				in_use.push_back(file);
+		}
+		for (const auto & [file, digest]: mesh_cache.sources(closed))
+		{
+			if (std::ranges::find(in_use, file) == in_use.end())
+				file_watch.unwatch(file);
+		}
+	}
+
+	bool reload_mesh(hot_reload::job & job)
+	{
+		nirt::scene::IAnimatedMesh * mesh = mesh_cache.load_mesh(job.path, job.bytes, job.digest);
+		if (! mesh)
+			return false;
+		// Same node, same cell: position and camera stay as they are.
+		for (std::size_t i=0; i<added_mesh_list.size(); i++)
+		{
+			if (added_mesh_files[i] != job.path)
+				continue;
+			added_mesh_list[i]->setMesh(mesh);
+			added_mesh_list[i]->setMaterialFlag(nirt::video::EMF_LIGHTING, false);
+		}
+		for (const auto & [file, digest]: mesh_cache.sources(job.path))
+			file_watch.watch(file, digest);
+		return true;
+	}
+	bool reload_texture(hot_reload::job & job)
+	{
+		content_cache::texture_swap swap = mesh_cache.reload_texture(job.path, job.bytes, job.digest);
+		if (! swap.from)
+			return false;
+		// Only the slots loaded from this file: others may share the old texture.
+		for (nirt::scene::IAnimatedMeshSceneNode * node: added_mesh_list)
+		{
+			for (const content_cache::texture_slot & slot: swap.slots)
+			{
+				if (slot.mesh != node->getMesh() || slot.buffer >= node->getMaterialCount())
+					continue;
+				nirt::video::SMaterial & material = node->getMaterial(slot.buffer);
+				if (material.getTexture(slot.layer) == swap.from)
+					material.setTexture(slot.layer, swap.to);
+			}
+		}
+		swap.from->drop();
+		return true;
+	}
+
+public:
+	// Swap in files changed on disk. Called by the render loop between frames.
+	void apply_reloads()
+	{
+		for (hot_reload::job & job: file_watch.take())
+		{
+			const bool is_mesh = std::ranges::find(added_mesh_files, job.path) != added_mesh_files.end();
+			if (! is_mesh && ! mesh_cache.has_texture_file(job.path))
+			{
+				log_debug("hot reload: not in use any more", job.path);
+				continue;
+			}
+			try
+			{
+				if (is_mesh ? this->reload_mesh(job) : this->reload_texture(job))
+					reloaded.emplace_back(job.path, job.changed);
+				else
+					log_warn("hot reload: can not decode", job.path);
+			}
+			catch (const std::exception & err)
+			{
+				log_error("hot reload:", job.path, err.what());
+			}
+		}
+	}
+	// Called after a frame is on screen.
+	void frame_presented()
+	{
+		const auto now = std::chrono::steady_clock::now();
+		for (const auto & [file, changed]: reloaded)
+		{
+			const utx::f64 latency_ms = std::chrono::duration<utx::f64, std::milli>(now - changed).count();
+			log_info("hot reload:", file, "| save to picture:", latency_ms, "ms");
+		}
+		reloaded.clear();
+	}
 };
 
 } // namespace mdinv